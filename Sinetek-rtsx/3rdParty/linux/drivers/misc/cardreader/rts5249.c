@@ -21,9 +21,10 @@ int rtsx_write_phy(struct rtsx_softc *, u_int8_t, u_int16_t);
 #define rtsx_pci_write_register                    rtsx_write
 #define rtsx_pci_write_phy_register                rtsx_write_phy
 #undef rtsx_pci_init_cmd
-#define rtsx_pci_init_cmd(pcr)                     ((void)0)
-#define rtsx_pci_add_cmd(pcr, cmd, reg, mask, val) rtsx_write(pcr, reg, mask, val)
-#define rtsx_pci_send_cmd(pcr, to)                 0
+#define rtsx_pci_init_cmd(pcr)                     rtsx_batch_init(pcr)
+#define rtsx_pci_add_cmd(pcr, cmd, reg, mask, val) rtsx_batch_add(pcr, cmd, reg, mask, val)
+#define rtsx_pci_send_cmd(pcr, to)                 rtsx_batch_send(pcr, to)
+#define rtsx_pci_get_cmd_data(pcr)                 rtsx_batch_data(pcr)
 
 static void rts5249_fill_driving(struct rtsx_pcr *pcr, u8 voltage)
 {
@@ -212,6 +213,41 @@ int rts525a_optimize_phy(struct rtsx_softc *pcr)
 	return 0;
 }
 
+int rts525a_switch_output_voltage(struct rtsx_softc *pcr, u8 voltage)
+{
+	int err;
+
+	switch (voltage) {
+	case OUTPUT_3V3:
+		err = rtsx_pci_write_register(pcr, LDO_CONFIG2,
+			LDO_D3318_MASK, LDO_D3318_33V);
+		if (err)
+			return err;
+		err = rtsx_pci_write_register(pcr, SD_PAD_CTL,
+			SD_IO_USING_1V8, 0);
+		if (err)
+			return err;
+		break;
+	case OUTPUT_1V8:
+		err = rtsx_pci_write_register(pcr, LDO_CONFIG2,
+			LDO_D3318_MASK, LDO_D3318_18V);
+		if (err)
+			return err;
+		err = rtsx_pci_write_register(pcr, SD_PAD_CTL,
+			SD_IO_USING_1V8, SD_IO_USING_1V8);
+		if (err)
+			return err;
+		break;
+	default:
+		return EINVAL;
+	}
+
+	/* set pad drive */
+	rtsx_pci_init_cmd(pcr);
+	rts5249_fill_driving(pcr, voltage);
+	return rtsx_pci_send_cmd(pcr, 100);
+}
+
 int rts525a_extra_init_hw(struct rtsx_pcr *pcr)
 {
 	rts5249_extra_init_hw(pcr);
@@ -20,6 +20,7 @@ typedef unsigned short u32;
 extern u8 Sinetek_rtsx_3rdParty_linux_card_drive_sel;
 void rtsx_base_fetch_vendor_settings(struct rtsx_softc *pcr);
 int rts525a_optimize_phy(struct rtsx_softc *pcr);
+int rts525a_switch_output_voltage(struct rtsx_softc *pcr, u8 voltage);
 
 #else
 #include <linux/rtsx_pci.h>
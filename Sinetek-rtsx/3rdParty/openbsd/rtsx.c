@@ -24,8 +24,13 @@
 #if __APPLE__
 #include "compat/openbsd.h"
 #include "3rdParty/linux/drivers/misc/cardreader/rts_pcr.h" /* rtsx_base_fetch_vendor_settings */
+#include <libkern/OSAtomic.h> /* OSBitOrAtomic, OSCompareAndSwap */
 extern int Sinetek_rtsx_boot_arg_mimic_linux;
 extern int Sinetek_rtsx_boot_arg_no_adma;
+extern int Sinetek_rtsx_boot_arg_no_fused_xfer;
+extern int Sinetek_rtsx_boot_arg_no_intr_filter;
+extern int Sinetek_rtsx_boot_arg_no_spin;
+extern int Sinetek_rtsx_boot_arg_no_uhs;
 extern int Sinetek_rtsx_boot_arg_timeout_shift;
 #if DEBUG
 volatile uint16_t waiting_for_cmd_opcode = 0;
@@ -75,6 +80,17 @@ volatile uint16_t waiting_for_cmd_opcode = 0;
 #define	RTSX_HOSTCMD_BUFSIZE	(sizeof(u_int32_t) * RTSX_HOSTCMD_MAX)
 #define	RTSX_DMA_DATA_BUFSIZE	MAXPHYS
 #define	RTSX_ADMA_DESC_SIZE	(sizeof(uint64_t) * SDMMC_MAXNSEGS)
+#if __APPLE__
+/*
+ * Limits of a single data command: the block count registers
+ * (SD_BLOCK_CNT_H/L) are 16 bits wide, the ADMA descriptors carry a 24-bit
+ * length and the descriptor table holds SDMMC_MAXNSEGS entries.
+ */
+#define	RTSX_MAX_BLOCK_CNT	0xffff
+#define	RTSX_MAX_DMATC		0x00ffffff
+#define	RTSX_ADMA_MAX_XFER	MIN(SDMMC_MAXXFER, \
+	    MIN(RTSX_MAX_DMATC & ~511, RTSX_MAX_BLOCK_CNT * 512))
+#endif
 
 #define READ4(sc, reg)							\
 	(bus_space_read_4((sc)->iot, (sc)->ioh, (reg)))
@@ -141,7 +157,15 @@ void	rtsx_hostcmd(u_int32_t *, int *, u_int8_t, u_int16_t, u_int8_t,
 int	rtsx_hostcmd_send(struct rtsx_softc *, int);
 u_int8_t rtsx_response_type(u_int16_t);
 int	rtsx_xfer_exec(struct rtsx_softc *, bus_dmamap_t, int);
+void	rtsx_xfer_queue(struct rtsx_softc *, struct sdmmc_command *,
+	    u_int32_t *, int *, u_int8_t);
 int	rtsx_xfer(struct rtsx_softc *, struct sdmmc_command *, u_int32_t *);
+#if __APPLE__
+int	rtsx_xfer_fused(struct rtsx_softc *, struct sdmmc_command *);
+void	rtsx_xfer_error(struct rtsx_softc *);
+int	rtsx_spin_budget(struct sdmmc_command *);
+void	rtsx_wait_account(struct rtsx_softc *, uint64_t, int);
+#endif
 int	rtsx_xfer_bounce(struct rtsx_softc *, struct sdmmc_command *);
 int	rtsx_xfer_adma(struct rtsx_softc *, struct sdmmc_command *);
 void	rtsx_card_insert(struct rtsx_softc *);
@@ -150,6 +174,16 @@ int	rtsx_led_enable(struct rtsx_softc *);
 int	rtsx_led_disable(struct rtsx_softc *);
 void	rtsx_save_regs(struct rtsx_softc *);
 void	rtsx_restore_regs(struct rtsx_softc *);
+#if __APPLE__
+int	rtsx_signal_voltage(sdmmc_chipset_handle_t, int);
+int	rtsx_execute_tuning(sdmmc_chipset_handle_t, int);
+int	rtsx_calc_clock(int, int, u_int8_t *, int *, int *);
+int	rtsx_switch_sd30_clock(struct rtsx_softc *, int, int);
+int	rtsx_change_phase(struct rtsx_softc *, u_int8_t, int);
+int	rtsx_tuning_cmd(struct rtsx_softc *, u_int8_t);
+u_int32_t rtsx_tuning_phase_map(struct rtsx_softc *);
+int	rtsx_final_phase(u_int32_t);
+#endif
 
 #ifdef RTSX_DEBUG
 #if __APPLE__
@@ -177,7 +211,15 @@ struct sdmmc_chip_functions rtsx_functions = {
 	/* command execution */
 	rtsx_exec_command,
 	/* card interrupt */
-	NULL, NULL
+	NULL, NULL,
+#if __APPLE__
+	/* UHS functions */
+	rtsx_signal_voltage,
+	/* hibernate */
+	NULL,
+	/* sampling point tuning */
+	rtsx_execute_tuning
+#endif
 };
 
 struct cfdriver rtsx_cd = {
@@ -199,6 +241,19 @@ rtsx_attach(struct rtsx_softc *sc, bus_space_tag_t iot,
 	sc->ioh = ioh;
 	sc->dmat = dmat;
 	sc->flags = flags;
+#if __APPLE__
+	/* No command buffer (and no batches through it) until it's loaded. */
+	sc->cmdbuf = NULL;
+	sc->batch_open = 0;
+	sc->wait_spin_us = 0;
+	sc->wait_timeout_ms = 0;
+	sc->stat_spin_waits = sc->stat_sleep_waits = 0;
+	bzero(sc->stat_wait_hist, sizeof(sc->stat_wait_hist));
+	mtx_init(&sc->intr_mtx, IPL_SDMMC);
+	sc->intr_deferred = 0;
+	sc->stat_intr_filtered = sc->stat_intr_deferred = 0;
+	sc->intr_filter = !Sinetek_rtsx_boot_arg_no_intr_filter;
+#endif
 
 	if (rtsx_init(sc, 1))
 		return 1;
@@ -229,6 +284,20 @@ rtsx_attach(struct rtsx_softc *sc, bus_space_tag_t iot,
 	if (bus_dmamem_map(sc->dmat, sc->adma_segs, rsegs, RTSX_ADMA_DESC_SIZE,
 	    &sc->admabuf, BUS_DMA_WAITOK|BUS_DMA_COHERENT))
 	    	goto free_adma;
+#if __APPLE__
+	/* One host command buffer for the lifetime of the controller,
+	 * commands are serialized by the sdmmc lock. */
+	if (bus_dmamem_alloc(sc->dmat, RTSX_HOSTCMD_BUFSIZE, 0, 0,
+	    sc->cmd_segs, 1, &rsegs, BUS_DMA_WAITOK|BUS_DMA_ZERO))
+		goto unmap_adma;
+	if (bus_dmamem_map(sc->dmat, sc->cmd_segs, rsegs, RTSX_HOSTCMD_BUFSIZE,
+	    &sc->cmdbuf, BUS_DMA_WAITOK|BUS_DMA_COHERENT))
+		goto free_cmd;
+	if (bus_dmamap_load(sc->dmat, sc->dmap_cmd, sc->cmdbuf,
+	    RTSX_HOSTCMD_BUFSIZE, NULL, BUS_DMA_WAITOK))
+		goto unmap_cmd;
+	sc->flags |= RTSX_F_HOSTCMD_READY;
+#endif
 
 	/*
 	 * Attach the generic SD/MMC bus driver.  (The bus driver must
@@ -243,12 +312,37 @@ rtsx_attach(struct rtsx_softc *sc, bus_space_tag_t iot,
 #if __APPLE__
 	if (Sinetek_rtsx_boot_arg_no_adma)
 		saa.caps &= ~SMC_CAPS_DMA;
+	/* rtsx_xfer() waits for the end of the card busy signal on writes */
+	saa.caps |= SMC_CAPS_WAIT_BUSY_END;
+	/* MMC High Speed is the same 50 MHz SD 2.0 clock as SD High Speed. */
+	saa.caps |= SMC_CAPS_MMC_HIGHSPEED;
+	/* DDR52 runs at 3.3V on the SD 3.0 clock, only known for RTS525A. */
+	if (sc->flags & RTSX_F_525A)
+		saa.caps |= SMC_CAPS_MMC_DDR52;
+	/*
+	 * 1.8V signalling and the SD 3.0 clock are only known (from the
+	 * Linux driver) for RTS525A.
+	 */
+	if ((sc->flags & RTSX_F_525A) && !Sinetek_rtsx_boot_arg_no_uhs)
+		saa.caps |= SMC_CAPS_UHS_SDR50 | SMC_CAPS_UHS_SDR104 |
+		    SMC_CAPS_UHS_DDR50;
 #endif
 	saa.dmat = sc->dmat;
+#if __APPLE__
+	/* Without ADMA, data goes through the RTSX_DMA_DATA_BUFSIZE bounce
+	 * buffer of rtsx_xfer_bounce(). */
+	saa.max_xfer = ISSET(saa.caps, SMC_CAPS_DMA) ?
+	    RTSX_ADMA_MAX_XFER : RTSX_DMA_DATA_BUFSIZE;
+#endif
 
 	sc->sdmmc = config_found(&sc->sc_dev, &saa, NULL);
+#if __APPLE__
+	if (sc->sdmmc == NULL)
+		goto unload_cmd;
+#else
 	if (sc->sdmmc == NULL)
 		goto unmap_adma;
+#endif
 
 	/* Now handle cards discovered during attachment. */
 	if (ISSET(sc->flags, RTSX_F_CARD_PRESENT))
@@ -256,6 +350,15 @@ rtsx_attach(struct rtsx_softc *sc, bus_space_tag_t iot,
 	
 	return 0;
 
+#if __APPLE__
+unload_cmd:
+	sc->flags &= ~RTSX_F_HOSTCMD_READY;
+	bus_dmamap_unload(sc->dmat, sc->dmap_cmd);
+unmap_cmd:
+	bus_dmamem_unmap(sc->dmat, sc->cmdbuf, RTSX_HOSTCMD_BUFSIZE);
+free_cmd:
+	bus_dmamem_free(sc->dmat, sc->cmd_segs, rsegs);
+#endif
 unmap_adma:
 	bus_dmamem_unmap(sc->dmat, sc->admabuf, RTSX_ADMA_DESC_SIZE);
 free_adma:
@@ -277,6 +380,11 @@ rtsx_init(struct rtsx_softc *sc, int attaching)
 	u_int8_t version;
 	int error;
 
+#if __APPLE__
+	/* Batches can't wait for the command engine until we're done. */
+	sc->flags &= ~RTSX_F_HOSTCMD_READY;
+#endif
+
 	/* Read IC version from dummy register. */
 	if (sc->flags & RTSX_F_5229) {
 		RTSX_READ(sc, RTSX_DUMMY_REG, &version);
@@ -427,6 +535,10 @@ rtsx_init(struct rtsx_softc *sc, int attaching)
 		RTSX_SET(sc, RTSX_OLT_LED_CTL, RTSX_OLT_LED_PERIOD);
 	}
 
+#if __APPLE__
+	if (sc->cmdbuf != NULL)
+		sc->flags |= RTSX_F_HOSTCMD_READY;
+#endif
 	return (0);
 }
 
@@ -553,6 +665,9 @@ rtsx_bus_power_off(struct rtsx_softc *sc)
 	int error;
 	u_int8_t disable3;
 
+#if __APPLE__
+	rtsx_batch_init(sc);
+#endif
 	error = rtsx_stop_sd_clock(sc);
 	if (error)
 		return error;
@@ -579,7 +694,11 @@ rtsx_bus_power_off(struct rtsx_softc *sc)
 	RTSX_WRITE(sc, RTSX_CARD_PULL_CTL2, RTSX_PULL_CTL_DISABLE12);
 	RTSX_WRITE(sc, RTSX_CARD_PULL_CTL3, disable3);
 
+#if __APPLE__
+	return rtsx_batch_send(sc, 100);
+#else
 	return 0;
+#endif
 }
 
 int
@@ -593,8 +712,17 @@ rtsx_bus_power_on(struct rtsx_softc *sc)
 		    RTSX_LDO_VCC_3V3);
 		if (err)
 			return (err);
+#if __APPLE__
+		/* A new card starts at 3.3V signalling (UHS-I switches later). */
+		err = rts525a_switch_output_voltage(sc, 0 /* OUTPUT_3V3 */);
+		if (err)
+			return (err);
+#endif
 	}
 
+#if __APPLE__
+	rtsx_batch_init(sc);
+#endif
 	/* Select SD card. */
 	RTSX_WRITE(sc, RTSX_CARD_SELECT, RTSX_SD_MOD_SEL);
 	RTSX_WRITE(sc, RTSX_CARD_SHARE_MODE, RTSX_CARD_SHARE_48_SD);
@@ -621,9 +749,17 @@ rtsx_bus_power_on(struct rtsx_softc *sc)
 	else
 		RTSX_SET(sc, RTSX_PWR_GATE_CTRL, RTSX_LDO3318_VCC1);
 
+#if __APPLE__
+	err = rtsx_batch_send(sc, 100);
+	if (err)
+		return (err);
+#endif
 	delay(200);
 
 	/* Full power. */
+#if __APPLE__
+	rtsx_batch_init(sc);
+#endif
 	RTSX_CLR(sc, RTSX_CARD_PWR_CTL, RTSX_SD_PWR_OFF);
 	if (sc->flags & RTSX_F_5209)
 		RTSX_CLR(sc, RTSX_PWR_GATE_CTRL, RTSX_LDO3318_OFF);
@@ -633,7 +769,11 @@ rtsx_bus_power_on(struct rtsx_softc *sc)
 	/* Enable SD card output. */
 	RTSX_WRITE(sc, RTSX_CARD_OE, RTSX_SD_OUTPUT_EN);
 
+#if __APPLE__
+	return rtsx_batch_send(sc, 100);
+#else
 	return 0;
+#endif
 }
 
 int
@@ -677,9 +817,13 @@ int
 rtsx_switch_sd_clock(struct rtsx_softc *sc, u_int8_t n, int div, int mcu)
 {
 #if __APPLE__
+	int error;
+
+	rtsx_batch_init(sc);
 	if (!Sinetek_rtsx_boot_arg_mimic_linux) {
-		/* Enable SD 2.0 mode. */
-		RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_SD_MODE_MASK);
+		/* Enable SD 2.0 mode (also when falling back from UHS-I). */
+		RTSX_CLR(sc, RTSX_SD_CFG1,
+		    RTSX_SD_MODE_MASK | RTSX_SD_ASYNC_FIFO_NOT_RST);
 	}
 #else
 	/* Enable SD 2.0 mode. */
@@ -712,6 +856,9 @@ rtsx_switch_sd_clock(struct rtsx_softc *sc, u_int8_t n, int div, int mcu)
 	RTSX_WRITE(sc, RTSX_SSC_DIV_N_0, n);
 	RTSX_SET(sc, RTSX_SSC_CTL1, RTSX_RSTB);
 #if __APPLE__
+	error = rtsx_batch_send(sc, 100);
+	if (error)
+		return error;
 	delay(130); /* be safe */
 #else
 	delay(100);
@@ -798,6 +945,16 @@ rtsx_bus_clock(sdmmc_chipset_handle_t sch, int freq, int timing)
 		error = rtsx_stop_sd_clock(sc);
 		goto ret;
 	}
+
+#if __APPLE__
+	if (timing == SDMMC_TIMING_UHS_SDR50 ||
+	    timing == SDMMC_TIMING_UHS_SDR104 ||
+	    timing == SDMMC_TIMING_UHS_DDR50 ||
+	    timing == SDMMC_TIMING_MMC_DDR52) {
+		error = rtsx_switch_sd30_clock(sc, freq, timing);
+		goto ret;
+	}
+#endif
 	
 #if __APPLE__
 	if (Sinetek_rtsx_boot_arg_mimic_linux) {
@@ -827,6 +984,30 @@ rtsx_bus_clock(sdmmc_chipset_handle_t sch, int freq, int timing)
 	}
 #endif // __APPLE__
 
+#if __APPLE__
+	/*
+	 * Configure the clock frequency. With -rtsx_mimic_linux the SSC runs
+	 * at twice the card clock, like Linux does. Clocks too slow for the
+	 * SSC (identification mode) go through the 1/128 divider, rounding
+	 * down to what it can produce.
+	 */
+	error = EINVAL;
+	if (freq > SDMMC_SDCLK_400KHZ)
+		error = rtsx_calc_clock(freq, Sinetek_rtsx_boot_arg_mimic_linux,
+		    &n, &div, &mcu);
+	if (error == 0) {
+		error = rtsx_write(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK,
+		    RTSX_CLK_DIVIDE_0);
+	} else {
+		error = rtsx_calc_clock(MIN(freq * 128,
+		    (RTSX_MAX_DIV_N + 2) * 1000), 0, &n, &div, &mcu);
+		if (error == 0)
+			error = rtsx_write(sc, RTSX_SD_CFG1,
+			    RTSX_CLK_DIVIDE_MASK, RTSX_CLK_DIVIDE_128);
+	}
+	if (error)
+		goto ret;
+#else
 	/* Round down to a supported frequency. */
 	if (freq >= SDMMC_SDCLK_50MHZ)
 		freq = SDMMC_SDCLK_50MHZ;
@@ -838,36 +1019,6 @@ rtsx_bus_clock(sdmmc_chipset_handle_t sch, int freq, int timing)
 	/*
 	 * Configure the clock frequency.
 	 */
-#if __APPLE__
-	if (Sinetek_rtsx_boot_arg_mimic_linux) {
-		/* These numbers come from the Linux driver's code. */
-		switch (freq) {
-		case SDMMC_SDCLK_400KHZ:
-			n = 128;
-			div = RTSX_CLK_DIV_4;
-			mcu = 7;
-			error = rtsx_write(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK, RTSX_CLK_DIVIDE_128);
-			if (error)
-				return error;
-			break;
-		case SDMMC_SDCLK_25MHZ:
-			n = 98;
-			div = RTSX_CLK_DIV_2;
-			mcu = 5;
-			RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK);
-			break;
-		case SDMMC_SDCLK_50MHZ:
-			n = 98;
-			div = RTSX_CLK_DIV_1;
-			mcu = 4;
-			RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK);
-			break;
-		default:
-			error = EINVAL;
-			goto ret;
-		}
-	} else {
-#endif
 	switch (freq) {
 	case SDMMC_SDCLK_400KHZ:
 		n = 80; /* minimum */
@@ -891,8 +1042,6 @@ rtsx_bus_clock(sdmmc_chipset_handle_t sch, int freq, int timing)
 		error = EINVAL;
 		goto ret;
 	}
-#if __APPLE__
-	}
 #endif
 
 	/*
@@ -904,6 +1053,350 @@ ret:
 	return error;
 }
 
+#if __APPLE__
+/*
+ * Compute the SSC parameters for a card clock of freq kHz, the way Linux'
+ * rtsx_pci_switch_clock() does: the SSC runs at n + 2 MHz (twice the card
+ * clock with double_clk) and is divided by 2^(div - 1) for frequencies
+ * which would need n below RTSX_MIN_DIV_N.
+ */
+int
+rtsx_calc_clock(int freq, int double_clk, u_int8_t *np, int *divp, int *mcup)
+{
+	int clk, n, div, mcu;
+
+	clk = freq / 1000; /* MHz */
+	if (double_clk)
+		clk *= 2;
+	n = clk - 2;
+	if (clk <= 2 || n > RTSX_MAX_DIV_N)
+		return EINVAL;
+
+	mcu = 125 / clk + 3;
+	if (mcu > 15)
+		mcu = 15;
+
+	div = RTSX_CLK_DIV_1;
+	while (n < RTSX_MIN_DIV_N && div < RTSX_CLK_DIV_8) {
+		n = (n + 2) * 2 - 2;
+		div++;
+	}
+	if (n < RTSX_MIN_DIV_N)
+		return EINVAL;
+
+	*np = n;
+	*divp = div;
+	*mcup = mcu;
+	return 0;
+}
+
+/*
+ * SD 3.0 mode clock, up to 208 MHz. This is Linux' sd_set_timing() followed
+ * by rtsx_pci_switch_clock(): SDR50/SDR104 use the variable phase clocks
+ * (vpclk), DDR50/DDR52 run the SSC clock at twice the bus clock and sample
+ * on both edges.
+ */
+int
+rtsx_switch_sd30_clock(struct rtsx_softc *sc, int freq, int timing)
+{
+	int ddr = (timing == SDMMC_TIMING_UHS_DDR50 ||
+	    timing == SDMMC_TIMING_MMC_DDR52);
+	u_int8_t n;
+	int div, mcu, ssc_depth;
+	int error;
+
+	error = rtsx_calc_clock(freq, ddr, &n, &div, &mcu);
+	if (error)
+		return error;
+
+	/* DDR50 asks for 1M, halved (one step deeper) for the double clock. */
+	ssc_depth = RTSX_SSC_DEPTH_2M;
+	if (div > RTSX_CLK_DIV_1) {
+		if (ssc_depth > div - 1)
+			ssc_depth -= div - 1;
+		else
+			ssc_depth = RTSX_SSC_DEPTH_4M;
+	}
+
+	rtsx_batch_init(sc);
+	RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_CLK_DIVIDE_MASK);
+	error = rtsx_write(sc, RTSX_SD_CFG1,
+	    RTSX_SD_MODE_MASK | RTSX_SD_ASYNC_FIFO_NOT_RST,
+	    (ddr ? RTSX_SDDDR_MODE : RTSX_SD30_MODE) |
+	    RTSX_SD_ASYNC_FIFO_NOT_RST);
+	if (error)
+		return error;
+	RTSX_SET(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ);
+	RTSX_WRITE(sc, RTSX_CARD_CLK_SOURCE,
+	    RTSX_CRC_VAR_CLK0 | RTSX_SD30_FIX_CLK | RTSX_SAMPLE_VAR_CLK1);
+
+	RTSX_WRITE(sc, RTSX_CLK_DIV, (div << 4) | mcu);
+	RTSX_CLR(sc, RTSX_SSC_CTL1, RTSX_RSTB);
+	error = rtsx_write(sc, RTSX_SSC_CTL2, RTSX_SSC_DEPTH_MASK, ssc_depth);
+	if (error)
+		return error;
+	RTSX_WRITE(sc, RTSX_SSC_DIV_N_0, n);
+	RTSX_SET(sc, RTSX_SSC_CTL1, RTSX_RSTB);
+	if (!ddr) {
+		RTSX_CLR(sc, RTSX_SD_VPCLK0_CTL, RTSX_PHASE_NOT_RESET);
+		RTSX_SET(sc, RTSX_SD_VPCLK0_CTL, RTSX_PHASE_NOT_RESET);
+	}
+	error = rtsx_batch_send(sc, 100);
+	if (error)
+		return error;
+	delay(130); /* SSC clock stable */
+
+	RTSX_CLR(sc, RTSX_CLK_CTL, RTSX_CLK_LOW_FREQ);
+
+	if (ddr) {
+		RTSX_SET(sc, RTSX_SD_PUSH_POINT_CTL, RTSX_DDR_VAR_TX_CMD_DAT);
+		RTSX_SET(sc, RTSX_SD_SAMPLE_POINT_CTL,
+		    RTSX_DDR_VAR_RX_DAT | RTSX_DDR_VAR_RX_CMD);
+	}
+
+	return 0;
+}
+
+/*
+ * Switch the SD bus signalling voltage. The 1.8V sequence follows Linux'
+ * sd_wait_voltage_stable_1() and sd_wait_voltage_stable_2(): after CMD11
+ * the card holds CMD and DAT[3:0] low, the clock is stopped while the pads
+ * switch, and the lines must come back high once it runs again.
+ */
+int
+rtsx_signal_voltage(sdmmc_chipset_handle_t sch, int voltage)
+{
+	struct rtsx_softc *sc = sch;
+	const u_int8_t lines = RTSX_SD_CMD_STATUS | RTSX_SD_DAT3_STATUS |
+	    RTSX_SD_DAT2_STATUS | RTSX_SD_DAT1_STATUS | RTSX_SD_DAT0_STATUS;
+	u_int8_t stat;
+	int error;
+
+	if (!(sc->flags & RTSX_F_525A))
+		return ENOTSUP;
+
+	if (voltage == SDMMC_SIGNAL_VOLTAGE_330)
+		return rts525a_switch_output_voltage(sc, 0 /* OUTPUT_3V3 */);
+	if (voltage != SDMMC_SIGNAL_VOLTAGE_180)
+		return EINVAL;
+
+	delay(1000);
+	RTSX_READ(sc, RTSX_SD_BUS_STAT, &stat);
+	if (stat & lines) {
+		UTL_ERR("%s: card did not drive the bus low (0x%02x)",
+		    DEVNAME(sc), stat);
+		return EIO;
+	}
+	RTSX_WRITE(sc, RTSX_SD_BUS_STAT, RTSX_SD_CLK_FORCE_STOP);
+
+	error = rts525a_switch_output_voltage(sc, 1 /* OUTPUT_1V8 */);
+	if (error)
+		return error;
+
+	/* Wait for the card's 1.8V regulator, then clock it again. */
+	IOSleep(50);
+	RTSX_WRITE(sc, RTSX_SD_BUS_STAT, RTSX_SD_CLK_TOGGLE_EN);
+	IOSleep(20);
+
+	RTSX_READ(sc, RTSX_SD_BUS_STAT, &stat);
+	if ((stat & lines) != lines) {
+		UTL_ERR("%s: bus not released at 1.8V (0x%02x)",
+		    DEVNAME(sc), stat);
+		rtsx_write(sc, RTSX_SD_BUS_STAT,
+		    RTSX_SD_CLK_TOGGLE_EN | RTSX_SD_CLK_FORCE_STOP, 0);
+		rtsx_write(sc, RTSX_CARD_CLK_EN, 0xff, 0);
+		return EIO;
+	}
+
+	RTSX_CLR(sc, RTSX_SD_BUS_STAT,
+	    RTSX_SD_CLK_TOGGLE_EN | RTSX_SD_CLK_FORCE_STOP);
+
+	return 0;
+}
+
+/*
+ * Select the TX (push) or RX (sample) point of the variable phase clock.
+ */
+int
+rtsx_change_phase(struct rtsx_softc *sc, u_int8_t phase, int rx)
+{
+	u_int16_t vp_ctl = rx ? RTSX_SD_VPRX_CTL : RTSX_SD_VPTX_CTL;
+	int error;
+
+	RTSX_SET(sc, RTSX_CLK_CTL, RTSX_CHANGE_CLK);
+	if (rx)
+		RTSX_SET(sc, RTSX_SD_CFG1, RTSX_SD_ASYNC_FIFO_NOT_RST);
+	RTSX_CLR(sc, vp_ctl, RTSX_PHASE_NOT_RESET);
+	error = rtsx_write(sc, vp_ctl, RTSX_PHASE_SELECT_MASK, phase);
+	if (error)
+		return error;
+	RTSX_SET(sc, vp_ctl, RTSX_PHASE_NOT_RESET);
+	RTSX_CLR(sc, RTSX_CLK_CTL, RTSX_CHANGE_CLK);
+	RTSX_CLR(sc, RTSX_SD_CFG1, RTSX_SD_ASYNC_FIFO_NOT_RST);
+
+	return 0;
+}
+
+/*
+ * Send one tuning block command (CMD19). The chip checks the 64-byte
+ * tuning pattern itself (RTSX_TM_AUTO_TUNING), so nothing is read back.
+ */
+int
+rtsx_tuning_cmd(struct rtsx_softc *sc, u_int8_t opcode)
+{
+	u_int32_t *cmdbuf = (u_int32_t *)sc->cmdbuf;
+	int ncmd = 0;
+	int error;
+
+	rtsx_hostcmd(cmdbuf, &ncmd,
+	    RTSX_WRITE_REG_CMD, RTSX_SD_CMD0, 0xff, 0x40 | opcode);
+	rtsx_hostcmd(cmdbuf, &ncmd, RTSX_WRITE_REG_CMD, RTSX_SD_CMD1, 0xff, 0);
+	rtsx_hostcmd(cmdbuf, &ncmd, RTSX_WRITE_REG_CMD, RTSX_SD_CMD2, 0xff, 0);
+	rtsx_hostcmd(cmdbuf, &ncmd, RTSX_WRITE_REG_CMD, RTSX_SD_CMD3, 0xff, 0);
+	rtsx_hostcmd(cmdbuf, &ncmd, RTSX_WRITE_REG_CMD, RTSX_SD_CMD4, 0xff, 0);
+	rtsx_hostcmd(cmdbuf, &ncmd,
+	    RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_L, 0xff, 0x40);
+	rtsx_hostcmd(cmdbuf, &ncmd,
+	    RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_H, 0xff, 0);
+	rtsx_hostcmd(cmdbuf, &ncmd,
+	    RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_L, 0xff, 1);
+	rtsx_hostcmd(cmdbuf, &ncmd,
+	    RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_H, 0xff, 0);
+	rtsx_hostcmd(cmdbuf, &ncmd, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2, 0xff,
+	    RTSX_SD_CALCULATE_CRC7 | RTSX_SD_CHECK_CRC7 |
+	    RTSX_SD_NO_WAIT_BUSY_END | RTSX_SD_CHECK_CRC16 | RTSX_SD_RSP_LEN_6);
+	rtsx_hostcmd(cmdbuf, &ncmd,
+	    RTSX_WRITE_REG_CMD, RTSX_CARD_DATA_SOURCE,
+	    0x01, RTSX_PINGPONG_BUFFER);
+	rtsx_hostcmd(cmdbuf, &ncmd,
+	    RTSX_WRITE_REG_CMD, RTSX_SD_TRANSFER,
+	    0xff, RTSX_TM_AUTO_TUNING | RTSX_SD_TRANSFER_START);
+	rtsx_hostcmd(cmdbuf, &ncmd,
+	    RTSX_CHECK_REG_CMD, RTSX_SD_TRANSFER,
+	    RTSX_SD_TRANSFER_END, RTSX_SD_TRANSFER_END);
+
+	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
+	    BUS_DMASYNC_PREWRITE);
+
+	error = rtsx_hostcmd_send(sc, ncmd);
+	if (error == 0)
+		error = rtsx_wait_intr(sc, RTSX_TRANS_OK_INT, 1);
+
+	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
+	    BUS_DMASYNC_POSTWRITE);
+	return error;
+}
+
+/*
+ * Try every RX phase once, return the map of those which read the tuning
+ * block correctly.
+ */
+u_int32_t
+rtsx_tuning_phase_map(struct rtsx_softc *sc)
+{
+	u_int32_t map = 0;
+	u_int8_t state;
+	int phase, i;
+
+	for (phase = 0; phase < RTSX_PHASE_MAX; phase++) {
+		if (rtsx_change_phase(sc, phase, 1))
+			continue;
+		rtsx_write(sc, RTSX_SD_CFG3, RTSX_SD_RSP_80CLK_TIMEOUT_EN,
+		    RTSX_SD_RSP_80CLK_TIMEOUT_EN);
+		if (rtsx_tuning_cmd(sc, SD_SEND_TUNING_BLOCK) == 0) {
+			map |= 1U << phase;
+		} else {
+			/* Wait for the data lines to go idle, drop the error. */
+			for (i = 0; i < 100; i++) {
+				if (rtsx_read(sc, RTSX_SD_DATA_STATE, &state) ||
+				    (state & RTSX_SD_DATA_IDLE))
+					break;
+				delay(100);
+			}
+			rtsx_write(sc, RTSX_CARD_STOP,
+			    RTSX_SD_STOP | RTSX_SD_CLR_ERR,
+			    RTSX_SD_STOP | RTSX_SD_CLR_ERR);
+		}
+		rtsx_write(sc, RTSX_SD_CFG3, RTSX_SD_RSP_80CLK_TIMEOUT_EN, 0);
+	}
+
+	return map;
+}
+
+/*
+ * Pick the middle of the longest (circular) run of good phases, like
+ * Linux' sd_search_final_phase(). Returns -1 if no phase works.
+ */
+int
+rtsx_final_phase(u_int32_t map)
+{
+	int start = 0, len, i;
+	int start_final = 0, len_final = 0;
+
+	if (map == 0)
+		return -1;
+
+	while (start < RTSX_PHASE_MAX) {
+		for (len = 0; len < RTSX_PHASE_MAX; len++) {
+			i = (start + len) % RTSX_PHASE_MAX;
+			if (!(map & (1U << i)))
+				break;
+		}
+		if (len > len_final) {
+			start_final = start;
+			len_final = len;
+		}
+		start += len ? len : 1;
+	}
+
+	return (start_final + len_final / 2) % RTSX_PHASE_MAX;
+}
+
+/*
+ * Find the sampling point for SDR50/SDR104. The phases come from the Linux
+ * driver's rts525a_init_params(); for SDR50/SDR104 the RX phase map is
+ * measured three times and only phases good in all of them are kept.
+ * DDR50 (and MMC DDR52) has no tuning command and uses fixed phases.
+ */
+int
+rtsx_execute_tuning(sdmmc_chipset_handle_t sch, int timing)
+{
+	struct rtsx_softc *sc = sch;
+	u_int32_t map = 0xffffffff;
+	int i, phase, error;
+
+	switch (timing) {
+	case SDMMC_TIMING_UHS_SDR104:
+		error = rtsx_change_phase(sc, 25, 0);
+		break;
+	case SDMMC_TIMING_UHS_SDR50:
+		error = rtsx_change_phase(sc, 29, 0);
+		break;
+	case SDMMC_TIMING_UHS_DDR50:
+	case SDMMC_TIMING_MMC_DDR52:
+		error = rtsx_change_phase(sc, 11, 0);
+		if (error)
+			return error;
+		return rtsx_change_phase(sc, 5, 1);
+	default:
+		return EINVAL;
+	}
+	if (error)
+		return error;
+
+	for (i = 0; i < 3 && map != 0; i++)
+		map &= rtsx_tuning_phase_map(sc);
+
+	phase = rtsx_final_phase(map);
+	UTL_LOG("%s: RX phase map 0x%08x, using phase %d", DEVNAME(sc),
+	    map, phase);
+	if (phase < 0)
+		return EIO;
+
+	return rtsx_change_phase(sc, phase, 1);
+}
+#endif // __APPLE__
+
 int
 rtsx_bus_width(sdmmc_chipset_handle_t sch, int width)
 {
@@ -945,6 +1438,13 @@ rtsx_write(struct rtsx_softc *sc, u_int16_t addr, u_int8_t mask, u_int8_t val)
 	int tries = 1024;
 	u_int32_t reg;
 
+#if __APPLE__
+	if (sc->batch_open) {
+		rtsx_batch_add(sc, RTSX_WRITE_REG_CMD, addr, mask, val);
+		return 0;
+	}
+#endif
+
 	WRITE4(sc, RTSX_HAIMR,
 	    RTSX_HAIMR_BUSY | RTSX_HAIMR_WRITE |
 	    (u_int32_t)(((addr & 0x3FFF) << 16) |
@@ -1199,6 +1699,102 @@ rtsx_hostcmd_send(struct rtsx_softc *sc, int ncmd)
 	return 0;
 }
 
+#if __APPLE__
+/*
+ * Register batches, like Linux' rtsx_pci_init_cmd()/rtsx_pci_add_cmd()/
+ * rtsx_pci_send_cmd(): the accesses are queued in the host command buffer
+ * and run with a single start and completion interrupt. Plain rtsx_write()
+ * calls between rtsx_batch_init() and rtsx_batch_send() are queued too, so
+ * existing RTSX_WRITE/SET/CLR sequences can be batched as they are. Don't
+ * rtsx_read() or delay() inside a batch, nothing has been written yet.
+ *
+ * While the command engine can't be used (during rtsx_init() or without a
+ * card, which makes rtsx_wait_intr() fail) the accesses run immediately.
+ */
+void
+rtsx_batch_init(struct rtsx_softc *sc)
+{
+	sc->batch_ncmd = 0;
+	sc->batch_error = 0;
+	sc->batch_ndata = 0;
+	sc->batch_direct = !ISSET(sc->flags, RTSX_F_HOSTCMD_READY) ||
+	    !ISSET(sc->flags, RTSX_F_CARD_PRESENT);
+	sc->batch_open = !sc->batch_direct;
+}
+
+void
+rtsx_batch_add(struct rtsx_softc *sc, u_int8_t cmd, u_int16_t reg,
+    u_int8_t mask, u_int8_t val)
+{
+	u_int8_t data;
+	int error = 0;
+
+	if (!sc->batch_direct) {
+		if (sc->batch_ncmd >= RTSX_HOSTCMD_MAX) {
+			sc->batch_error = ENOMEM;
+			return;
+		}
+		rtsx_hostcmd((u_int32_t *)sc->cmdbuf, &sc->batch_ncmd, cmd,
+		    reg, mask, val);
+		return;
+	}
+
+	if (sc->batch_error)
+		return;
+	switch (cmd) {
+	case RTSX_WRITE_REG_CMD:
+		error = rtsx_write(sc, reg, mask, val);
+		break;
+	case RTSX_READ_REG_CMD:
+	case RTSX_CHECK_REG_CMD:
+		error = rtsx_read(sc, reg, &data);
+		if (error == 0 && cmd == RTSX_CHECK_REG_CMD &&
+		    (data & mask) != val)
+			error = EIO;
+		if (error == 0 && sc->batch_ndata >= RTSX_BATCH_DATA_MAX)
+			error = ENOMEM;
+		if (error == 0)
+			sc->batch_data[sc->batch_ndata++] = data;
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+	sc->batch_error = error;
+}
+
+int
+rtsx_batch_send(struct rtsx_softc *sc, int timeout_ms)
+{
+	int error;
+
+	sc->batch_open = 0;
+	if (sc->batch_direct || sc->batch_error || sc->batch_ncmd == 0)
+		return sc->batch_error;
+
+	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
+	    BUS_DMASYNC_PREREAD);
+	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
+	    BUS_DMASYNC_PREWRITE);
+	error = rtsx_hostcmd_send(sc, sc->batch_ncmd);
+	if (error == 0)
+		error = rtsx_wait_intr(sc, RTSX_TRANS_OK_INT,
+		    (timeout_ms + 999) / 1000);
+	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
+	    BUS_DMASYNC_POSTREAD);
+	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
+	    BUS_DMASYNC_POSTWRITE);
+	return error;
+}
+
+/* Values of the READ/CHECK accesses of the last batch, in queue order. */
+u_int8_t *
+rtsx_batch_data(struct rtsx_softc *sc)
+{
+	return sc->batch_direct ? sc->batch_data : (u_int8_t *)sc->cmdbuf;
+}
+#endif
+
 int
 rtsx_xfer_exec(struct rtsx_softc *sc, bus_dmamap_t dmap, int dmaflags)
 {
@@ -1214,23 +1810,19 @@ rtsx_xfer_exec(struct rtsx_softc *sc, bus_dmamap_t dmap, int dmaflags)
 	return rtsx_wait_intr(sc, RTSX_TRANS_OK_INT, 10);
 }
 
-int
-rtsx_xfer(struct rtsx_softc *sc, struct sdmmc_command *cmd, u_int32_t *cmdbuf)
+/*
+ * Queue the commands which set up the DMA engine and run the data phase
+ * of cmd. With rsp_type 0 the command itself must already have been sent
+ * (AUTO_READ3/WRITE3), otherwise the chip sends it first.
+ */
+void
+rtsx_xfer_queue(struct rtsx_softc *sc, struct sdmmc_command *cmd,
+    u_int32_t *cmdbuf, int *ncmd, u_int8_t rsp_type)
 {
-	int ncmd, dma_dir, error, tmode;
+	int dma_dir, tmode;
 	int read = ISSET(cmd->c_flags, SCF_CMD_READ);
 	u_int8_t cfg2;
 
-	DPRINTF(3,("%s: %s xfer: %d bytes with block size %d\n", DEVNAME(sc),
-	    read ? "read" : "write",
-	    cmd->c_datalen, cmd->c_blklen));
-
-	if (cmd->c_datalen > RTSX_DMA_DATA_BUFSIZE) {
-		DPRINTF(3, ("%s: cmd->c_datalen too large: %d > %d\n",
-		    DEVNAME(sc), cmd->c_datalen, RTSX_DMA_DATA_BUFSIZE));
-		return ENOMEM;
-	}
-
 	/* Configure DMA transfer mode parameters. */
 	cfg2 = RTSX_SD_NO_CHECK_WAIT_CRC_TO | RTSX_SD_CHECK_CRC16 |
 	    RTSX_SD_NO_WAIT_BUSY_END | RTSX_SD_RSP_LEN_0;
@@ -1248,54 +1840,97 @@ rtsx_xfer(struct rtsx_softc *sc, struct sdmmc_command *cmd, u_int32_t *cmdbuf)
 		 * send CMD 12 manually after writing multiple blocks. */
 		tmode = RTSX_TM_AUTO_WRITE3;
 		cfg2 |= RTSX_SD_NO_CALCULATE_CRC7 | RTSX_SD_NO_CHECK_CRC7;
+#if __APPLE__
+		/* Let the chip hold back TRANS_OK until the card releases
+		 * DAT0, so that the end of programming is signalled by the
+		 * interrupt and does not have to be polled with SEND_STATUS. */
+		cfg2 |= RTSX_SD_WAIT_BUSY_END;
+#endif
 	}
+#if __APPLE__
+	/* Fused with the command: the chip sends it and checks the R1
+	 * response before moving the data (no CMD 12 either way). */
+	if (rsp_type != 0) {
+		tmode = read ? RTSX_TM_AUTO_READ2 : RTSX_TM_AUTO_WRITE2;
+		cfg2 &= ~(RTSX_SD_NO_CALCULATE_CRC7 | RTSX_SD_NO_CHECK_CRC7 |
+		    RTSX_SD_RSP_LEN_17 | RTSX_SD_RSP_LEN_6);
+		cfg2 |= rsp_type;
+	}
+#endif
 
-	ncmd = 0;
-
-	rtsx_hostcmd(cmdbuf, &ncmd, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2,
+	rtsx_hostcmd(cmdbuf, ncmd, RTSX_WRITE_REG_CMD, RTSX_SD_CFG2,
 	    0xff, cfg2); 
 
 	/* Queue commands to configure data transfer size. */
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_L, 0xff,
 	    (cmd->c_blklen & 0xff));
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_SD_BYTE_CNT_H, 0xff,
 	    (cmd->c_blklen >> 8));
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_L, 0xff,
 	    ((cmd->c_datalen / cmd->c_blklen) & 0xff));
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_SD_BLOCK_CNT_H, 0xff,
 	    ((cmd->c_datalen / cmd->c_blklen) >> 8));
 
 	/* Use the DMA ring buffer for commands which transfer data. */
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_CARD_DATA_SOURCE, 0x01, RTSX_RING_BUFFER);
 
 	/* Configure DMA controller. */
-	rtsx_hostcmd(cmdbuf, &ncmd, RTSX_WRITE_REG_CMD, RTSX_IRQSTAT0,
+	rtsx_hostcmd(cmdbuf, ncmd, RTSX_WRITE_REG_CMD, RTSX_IRQSTAT0,
 	    RTSX_DMA_DONE_INT, RTSX_DMA_DONE_INT);
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_DMATC3, 0xff, cmd->c_datalen >> 24);
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_DMATC2, 0xff, cmd->c_datalen >> 16);
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_DMATC1, 0xff, cmd->c_datalen >> 8);
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_DMATC0, 0xff, cmd->c_datalen);
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_DMACTL,
 	    0x03 | RTSX_DMA_PACK_SIZE_MASK,
 	    dma_dir | RTSX_DMA_EN | RTSX_DMA_512);
 
 	/* Queue commands to perform SD transfer. */
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_SD_TRANSFER,
 	    0xff, tmode | RTSX_SD_TRANSFER_START);
-	rtsx_hostcmd(cmdbuf, &ncmd,
+	rtsx_hostcmd(cmdbuf, ncmd,
 	    RTSX_CHECK_REG_CMD, RTSX_SD_TRANSFER,
 	    RTSX_SD_TRANSFER_END, RTSX_SD_TRANSFER_END);
+}
+
+int
+rtsx_xfer(struct rtsx_softc *sc, struct sdmmc_command *cmd, u_int32_t *cmdbuf)
+{
+	int ncmd, error;
+	int read = ISSET(cmd->c_flags, SCF_CMD_READ);
+
+	DPRINTF(3,("%s: %s xfer: %d bytes with block size %d\n", DEVNAME(sc),
+	    read ? "read" : "write",
+	    cmd->c_datalen, cmd->c_blklen));
+
+#if __APPLE__
+	if (cmd->c_datalen > (cmd->c_dmamap ? RTSX_ADMA_MAX_XFER :
+	    RTSX_DMA_DATA_BUFSIZE)) {
+		DPRINTF(3, ("%s: cmd->c_datalen too large: %d\n",
+		    DEVNAME(sc), cmd->c_datalen));
+		return ENOMEM;
+	}
+#else
+	if (cmd->c_datalen > RTSX_DMA_DATA_BUFSIZE) {
+		DPRINTF(3, ("%s: cmd->c_datalen too large: %d > %d\n",
+		    DEVNAME(sc), cmd->c_datalen, RTSX_DMA_DATA_BUFSIZE));
+		return ENOMEM;
+	}
+#endif
+
+	ncmd = 0;
+	rtsx_xfer_queue(sc, cmd, cmdbuf, &ncmd, 0);
 
 	error = rtsx_hostcmd_send(sc, ncmd);
 	if (error)
@@ -1314,6 +1949,35 @@ ret:
 	return error;
 }
 
+#if __APPLE__
+/*
+ * Block reads and writes are sent together with their data phase in one
+ * host command buffer, so that they cost a single interrupt.
+ */
+int
+rtsx_xfer_fused(struct rtsx_softc *sc, struct sdmmc_command *cmd)
+{
+	if (Sinetek_rtsx_boot_arg_no_fused_xfer)
+		return 0;
+	if (cmd->c_datalen == 0 ||
+	    (cmd->c_data == NULL && cmd->c_dmamap == NULL))
+		return 0;
+	if (cmd->c_datalen > (cmd->c_dmamap ? RTSX_ADMA_MAX_XFER :
+	    RTSX_DMA_DATA_BUFSIZE))
+		return 0;
+
+	switch (cmd->c_opcode) {
+	case MMC_READ_BLOCK_SINGLE:
+	case MMC_READ_BLOCK_MULTIPLE:
+	case MMC_WRITE_BLOCK_SINGLE:
+	case MMC_WRITE_BLOCK_MULTIPLE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+#endif
+
 int
 rtsx_xfer_bounce(struct rtsx_softc *sc, struct sdmmc_command *cmd)
 {
@@ -1438,18 +2102,66 @@ rtsx_xfer_adma(struct rtsx_softc *sc, struct sdmmc_command *cmd)
 	return error;
 }
 
+#if __APPLE__
+/*
+ * How long (us) to spin on the completion of cmd before going to sleep.
+ * Short commands are done before a sleep and wakeup round trip would be.
+ */
+int
+rtsx_spin_budget(struct sdmmc_command *cmd)
+{
+	if (Sinetek_rtsx_boot_arg_no_spin)
+		return 0;
+
+	switch (cmd->c_opcode) {
+	case MMC_SEND_STATUS:
+	case MMC_SET_BLOCKLEN:
+	case MMC_SET_BLOCK_COUNT:
+	case MMC_APP_CMD:
+	case MMC_STOP_TRANSMISSION:	/* sleeps if the card stays busy */
+		return 50;
+	case MMC_READ_BLOCK_SINGLE:
+		return 200;
+	default:
+		return 0;
+	}
+}
+#endif
+
+#if __APPLE__
+/* Report a failed data transfer and prepare for the next command. */
+void
+rtsx_xfer_error(struct rtsx_softc *sc)
+{
+	u_int8_t stat1;
+
+	if (rtsx_read(sc, RTSX_SD_STAT1, &stat1) == 0 &&
+	    (stat1 & RTSX_SD_CRC_ERR))
+		printf("%s: CRC error\n", DEVNAME(sc));
+	if (Sinetek_rtsx_boot_arg_mimic_linux) {
+		rtsx_soft_reset(sc);
+	}
+}
+#endif
+
 void
 rtsx_exec_command(sdmmc_chipset_handle_t sch, struct sdmmc_command *cmd)
 {
 	struct rtsx_softc *sc = sch;
+#if !__APPLE__
 	bus_dma_segment_t segs;
 	int rsegs;
+#endif
 	caddr_t cmdkvap;
 	u_int32_t *cmdbuf;
 	u_int8_t rsp_type;
 	u_int16_t r;
 	int ncmd;
+	int timo = 1;
 	int error = 0;
+#if __APPLE__
+	int fused = rtsx_xfer_fused(sc, cmd);
+#endif
 
 	DPRINTF(3,("%s: executing cmd %hu\n", DEVNAME(sc), cmd->c_opcode));
 
@@ -1468,6 +2180,10 @@ rtsx_exec_command(sdmmc_chipset_handle_t sch, struct sdmmc_command *cmd)
 		goto ret;
 	}
 
+#if __APPLE__
+	/* The host command buffer stays mapped and loaded from attach on. */
+	cmdkvap = sc->cmdbuf;
+#else
 	/* Allocate and map the host command buffer. */
 	error = bus_dmamem_alloc(sc->dmat, RTSX_HOSTCMD_BUFSIZE, 0, 0, &segs, 1,
 	    &rsegs, BUS_DMA_WAITOK|BUS_DMA_ZERO);
@@ -1477,6 +2193,7 @@ rtsx_exec_command(sdmmc_chipset_handle_t sch, struct sdmmc_command *cmd)
 	    &cmdkvap, BUS_DMA_WAITOK|BUS_DMA_COHERENT);
 	if (error)
 		goto free_cmdbuf;
+#endif
 
 	/* The command buffer queues commands the host controller will
 	 * run asynchronously. */
@@ -1495,6 +2212,17 @@ rtsx_exec_command(sdmmc_chipset_handle_t sch, struct sdmmc_command *cmd)
 	rtsx_hostcmd(cmdbuf, &ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_SD_CMD4, 0xff, cmd->c_arg);
 
+#if __APPLE__
+	if (fused) {
+		/* The data phase sets the response type and starts the
+		 * transfer; read the R1 response back once it is done. */
+		rtsx_xfer_queue(sc, cmd, cmdbuf, &ncmd, rsp_type);
+		for (r = RTSX_SD_CMD0; r <= RTSX_SD_CMD4; r++)
+			rtsx_hostcmd(cmdbuf, &ncmd, RTSX_READ_REG_CMD, r, 0, 0);
+		goto load_cmdbuf;
+	}
+#endif
+
 	/* Queue command to set response type. */
 	rtsx_hostcmd(cmdbuf, &ncmd,
 	    RTSX_WRITE_REG_CMD, RTSX_SD_CFG2, 0xff, rsp_type);
@@ -1524,31 +2252,74 @@ rtsx_exec_command(sdmmc_chipset_handle_t sch, struct sdmmc_command *cmd)
 			rtsx_hostcmd(cmdbuf, &ncmd, RTSX_READ_REG_CMD, r, 0, 0);
 	}
 
+#if __APPLE__
+load_cmdbuf:
+	/* Sync command DMA buffer. */
+#else
 	/* Load and sync command DMA buffer. */
 	error = bus_dmamap_load(sc->dmat, sc->dmap_cmd, cmdkvap,
 	    RTSX_HOSTCMD_BUFSIZE, NULL, BUS_DMA_WAITOK);
 	if (error)
 		goto unmap_cmdbuf;
+#endif
 
 	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
 	    BUS_DMASYNC_PREREAD);
 	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
 	    BUS_DMASYNC_PREWRITE);
 
+#if __APPLE__
+	/*
+	 * Busy commands (ERASE) may hold the card for much longer than 1s.
+	 * The timeout is also handed to rtsx_wait_intr() in ms, so that it
+	 * isn't taken for the default 1s and cut short with mimic_linux.
+	 */
+	if (cmd->c_timeout > 0)
+		timo = (cmd->c_timeout + 999) / 1000;
+#endif
+
+#if __APPLE__
+	if (fused) {
+		/* One submission and one interrupt for command and data. */
+		DPRINTF(3,("%s: fused %s xfer: %d bytes\n", DEVNAME(sc),
+		    ISSET(cmd->c_flags, SCF_CMD_READ) ? "read" : "write",
+		    cmd->c_datalen));
+		sc->wait_spin_us = rtsx_spin_budget(cmd);
+		error = rtsx_hostcmd_send(sc, ncmd);
+		if (error == 0)
+			error = cmd->c_dmamap ? rtsx_xfer_adma(sc, cmd) :
+			    rtsx_xfer_bounce(sc, cmd);
+		if (error) {
+			UTL_ERR("fused xfer error(%s): %d",
+			    cmd->c_dmamap ? "ADMA" : "bounce", error);
+			rtsx_xfer_error(sc);
+			goto unload_cmdbuf;
+		}
+		goto response;
+	}
+#endif
+
 	/* Run the command queue and wait for completion. */
+#if __APPLE__
+	sc->wait_spin_us = rtsx_spin_budget(cmd);
+	sc->wait_timeout_ms = cmd->c_timeout;
+#endif
 	error = rtsx_hostcmd_send(sc, ncmd);
 #if __APPLE__ && DEBUG
 	if (error == 0) {
 		waiting_for_cmd_opcode = cmd->c_opcode;
-		error = rtsx_wait_intr(sc, RTSX_TRANS_OK_INT, 1);
+		error = rtsx_wait_intr(sc, RTSX_TRANS_OK_INT, timo);
 	}
 #else
 	if (error == 0)
-		error = rtsx_wait_intr(sc, RTSX_TRANS_OK_INT, 1);
+		error = rtsx_wait_intr(sc, RTSX_TRANS_OK_INT, timo);
 #endif
 	if (error)
 		goto unload_cmdbuf;
 
+#if __APPLE__
+response:
+#endif
 	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
 	    BUS_DMASYNC_POSTREAD);
 	bus_dmamap_sync(sc->dmat, sc->dmap_cmd, 0, RTSX_HOSTCMD_BUFSIZE,
@@ -1569,6 +2340,15 @@ rtsx_exec_command(sdmmc_chipset_handle_t sch, struct sdmmc_command *cmd)
 		}
 	}
 
+#if __APPLE__
+	/* Zero-copy transfers come with a loaded dmamap but no kernel VA. */
+	if (!fused &&
+	    (cmd->c_data || (cmd->c_dmamap && cmd->c_datalen > 0))) {
+		error = rtsx_xfer(sc, cmd, cmdbuf);
+		if (error)
+			rtsx_xfer_error(sc);
+	}
+#else
 	if (cmd->c_data) {
 		error = rtsx_xfer(sc, cmd, cmdbuf);
 		if (error) {
@@ -1577,20 +2357,18 @@ rtsx_exec_command(sdmmc_chipset_handle_t sch, struct sdmmc_command *cmd)
 			if (rtsx_read(sc, RTSX_SD_STAT1, &stat1) == 0 &&
 			    (stat1 & RTSX_SD_CRC_ERR))
 				printf("%s: CRC error\n", DEVNAME(sc));
-#if __APPLE__
-			if (Sinetek_rtsx_boot_arg_mimic_linux) {
-				rtsx_soft_reset(sc);
-			}
-#endif
 		}
 	}
+#endif
 
 unload_cmdbuf:
+#if !__APPLE__
 	bus_dmamap_unload(sc->dmat, sc->dmap_cmd);
 unmap_cmdbuf:
 	bus_dmamem_unmap(sc->dmat, cmdkvap, RTSX_HOSTCMD_BUFSIZE);
 free_cmdbuf:
 	bus_dmamem_free(sc->dmat, &segs, rsegs);
+#endif
 ret:
 	SET(cmd->c_flags, SCF_ITSDONE);
 	cmd->c_error = error;
@@ -1627,10 +2405,39 @@ rtsx_wait_intr(struct rtsx_softc *sc, int mask, int secs)
 	int error = 0;
 	int s;
 
+#if __APPLE__
+	uint64_t start = mach_absolute_time(), deadline;
+	int spin_us = sc->wait_spin_us, spun = 0;
+	int timeout_ms = sc->wait_timeout_ms;
+
+	sc->wait_spin_us = 0;
+	sc->wait_timeout_ms = 0;
+#endif
 	mask |= RTSX_TRANS_FAIL_INT;
 
 	s = splsdmmc();
+#if __APPLE__
+	/*
+	 * Spin on the status the interrupt handler posts, for up to spin_us,
+	 * which saves the wakeup of this thread for fast commands. This is
+	 * done without intr_mtx, which the interrupt handler needs to post.
+	 */
+	if (spin_us > 0 &&
+	    (*(volatile u_int32_t *)&sc->intr_status & mask) == 0) {
+		nanoseconds_to_absolutetime(spin_us * 1000ULL, &deadline);
+		deadline += start;
+		do {
+			spun = (*(volatile u_int32_t *)&sc->intr_status &
+			    mask) != 0;
+		} while (!spun && mach_absolute_time() < deadline);
+	}
+	mtx_enter(&sc->intr_mtx);
 	status = sc->intr_status & mask;
+	if (spun)
+		rtsx_wait_account(sc, start, 1);
+#else
+	status = sc->intr_status & mask;
+#endif
 	while (status == 0) {
 #if __APPLE__
 		/* Whenever OpenBSD is waiting 1 sec, the Linux driver only waits for 100 ms. Some commands
@@ -1642,8 +2449,10 @@ rtsx_wait_intr(struct rtsx_softc *sc, int mask, int secs)
 		   In Linux, this method is IN rtsx_pci_send_cmd(), which is equivalent to OpenBSD's
 		     rtsx_hostcmd_send() +
 		     rtsx_wait_intr()
+		   A timeout set by the command itself (c_timeout, e.g. ERASE) is used as is.
 		 */
-		uint64_t timeout_ns = (Sinetek_rtsx_boot_arg_mimic_linux && secs == 1 ? 100000000 : SEC_TO_NSEC(secs));
+		uint64_t timeout_ns = timeout_ms > 0 ? timeout_ms * 1000000ULL :
+		    (Sinetek_rtsx_boot_arg_mimic_linux && secs == 1 ? 100000000 : SEC_TO_NSEC(secs));
 		if (Sinetek_rtsx_boot_arg_timeout_shift > 0)
 			timeout_ns <<= Sinetek_rtsx_boot_arg_timeout_shift;
 		else if (Sinetek_rtsx_boot_arg_timeout_shift < 0)
@@ -1652,7 +2461,8 @@ rtsx_wait_intr(struct rtsx_softc *sc, int mask, int secs)
 		uint64_t startTime, endTime, elapsed_ns;
 		startTime = mach_absolute_time();
 #endif
-		if (tsleep_nsec(&sc->intr_status, PRIBIO, "rtsxintr", timeout_ns) == EWOULDBLOCK) {
+		if (msleep_nsec(&sc->intr_status, &sc->intr_mtx, PRIBIO, "rtsxintr",
+		    timeout_ns) == EWOULDBLOCK) {
 #if DEBUG
 			endTime = mach_absolute_time();
 			absolutetime_to_nanoseconds(endTime - startTime, &elapsed_ns);
@@ -1664,7 +2474,14 @@ rtsx_wait_intr(struct rtsx_softc *sc, int mask, int secs)
 		if (tsleep_nsec(&sc->intr_status, PRIBIO, "rtsxintr",
 		    SEC_TO_NSEC(secs)) == EWOULDBLOCK) {
 #endif
+#if __APPLE__
+			/* The reset polls registers, don't spin the lock. */
+			mtx_leave(&sc->intr_mtx);
 			rtsx_soft_reset(sc);
+			mtx_enter(&sc->intr_mtx);
+#else
+			rtsx_soft_reset(sc);
+#endif
 			error = ETIMEDOUT;
 			break;
 		}
@@ -1675,8 +2492,15 @@ rtsx_wait_intr(struct rtsx_softc *sc, int mask, int secs)
 			mmcCmd2str(waiting_for_cmd_opcode));
 #endif
 		status = sc->intr_status & mask;
+#if __APPLE__
+		if (status != 0)
+			rtsx_wait_account(sc, start, 0);
+#endif
 	}
 	sc->intr_status &= ~status;
+#if __APPLE__
+	mtx_leave(&sc->intr_mtx);
+#endif
 
 	/* Has the card disappeared? */
 	if (!ISSET(sc->flags, RTSX_F_CARD_PRESENT))
@@ -1690,6 +2514,29 @@ rtsx_wait_intr(struct rtsx_softc *sc, int mask, int secs)
 	return error;
 }
 
+#if __APPLE__
+/* Count a completed wait which started at start, see RTSX_WAIT_HIST_MAX. */
+void
+rtsx_wait_account(struct rtsx_softc *sc, uint64_t start, int spun)
+{
+	static const uint64_t limits_us[RTSX_WAIT_HIST_MAX - 1] = {
+		10, 50, 100, 500, 1000, 10000
+	};
+	uint64_t ns;
+	int i;
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &ns);
+	for (i = 0; i < RTSX_WAIT_HIST_MAX - 1; i++)
+		if (ns < limits_us[i] * 1000)
+			break;
+	sc->stat_wait_hist[i]++;
+	if (spun)
+		sc->stat_spin_waits++;
+	else
+		sc->stat_sleep_waits++;
+}
+#endif
+
 void
 rtsx_card_insert(struct rtsx_softc *sc)
 {
@@ -1750,9 +2597,84 @@ rtsx_intr(void *arg)
 	}
 
 	if (status & (RTSX_TRANS_OK_INT | RTSX_TRANS_FAIL_INT)) {
+#if __APPLE__
+		mtx_enter(&sc->intr_mtx);
+		sc->intr_status |= status;
+		wakeup(&sc->intr_status);
+		mtx_leave(&sc->intr_mtx);
+#else
+		sc->intr_status |= status;
+		wakeup(&sc->intr_status);
+#endif
+	}
+
+	return 1;
+}
+
+#if __APPLE__
+/*
+ * Interrupt filter, called in primary interrupt context (no logging, no
+ * sleeping) instead of rtsx_intr() when sc->intr_filter is set. The
+ * interrupt is acknowledged and a command completion is posted to the
+ * waiting thread right here. Returns non-zero if rtsx_intr_deferred()
+ * has to run on the workloop, which is only for card insertion/removal.
+ */
+int
+rtsx_intr_filter(struct rtsx_softc *sc)
+{
+	u_int32_t enabled, status;
+
+	status = READ4(sc, RTSX_BIPR);
+	if (status == 0 || status == 0xffffffff)
+		return 0;
+	enabled = READ4(sc, RTSX_BIER);
+	if ((enabled & status) == 0)
+		return 0;
+
+	/* Ack interrupts. */
+	WRITE4(sc, RTSX_BIPR, status);
+
+	if (status & (RTSX_TRANS_OK_INT | RTSX_TRANS_FAIL_INT)) {
+		/* intr_mtx blocks interrupts, see mtx_init(). */
+		mtx_enter(&sc->intr_mtx);
 		sc->intr_status |= status;
 		wakeup(&sc->intr_status);
+		sc->stat_intr_filtered++;
+		mtx_leave(&sc->intr_mtx);
+	}
+
+	if (status & RTSX_SD_INT) {
+		OSBitOrAtomic(status, &sc->intr_deferred);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The part of rtsx_intr() which needs a thread: card insertion/removal
+ * latched by rtsx_intr_filter().
+ */
+int
+rtsx_intr_deferred(struct rtsx_softc *sc)
+{
+	u_int32_t status;
+
+	do {
+		status = sc->intr_deferred;
+	} while (!OSCompareAndSwap(status, 0, &sc->intr_deferred));
+
+	if ((status & RTSX_SD_INT) == 0)
+		return 0;
+	sc->stat_intr_deferred++;
+
+	/* Events may have been latched together, look at the slot now. */
+	if (READ4(sc, RTSX_BIPR) & RTSX_SD_EXIST) {
+		if (!ISSET(sc->flags, RTSX_F_CARD_PRESENT))
+			rtsx_card_insert(sc);
+	} else {
+		rtsx_card_eject(sc);
 	}
 
 	return 1;
 }
+#endif
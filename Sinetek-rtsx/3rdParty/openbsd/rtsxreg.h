@@ -279,6 +279,9 @@
 
 #define	RTSX_SD_PUSH_POINT_CTL	0xFDA8
 #define	RTSX_SD20_TX_NEG_EDGE	0x00
+#if __APPLE__
+#define	RTSX_DDR_VAR_TX_CMD_DAT	0x80
+#endif
 
 #define	RTSX_SD_CMD0		0xFDA9
 #define	RTSX_SD_CMD1		0xFDAA
@@ -526,4 +529,31 @@
 #define	RTSX_IC_VERSION_C	0x02
 #define	RTSX_IC_VERSION_D	0x03
 
+#if __APPLE__
+/* SD 3.0 (UHS-I) bus modes, see Linux' rtsx_pci_sdmmc.c */
+#define	RTSX_SD_ASYNC_FIFO_NOT_RST	0x10	/* in RTSX_SD_CFG1 */
+#define	RTSX_SD_CFG3		0xFDA2
+#define	RTSX_SD_RSP_80CLK_TIMEOUT_EN	0x01
+#define	RTSX_SD_DATA_IDLE	0x80		/* in RTSX_SD_DATA_STATE */
+#define	RTSX_CHANGE_CLK		0x01		/* in RTSX_CLK_CTL */
+
+/* Variable phase clocks: TX (push) and RX (sample) points. */
+#define	RTSX_SD_VPCLK0_CTL	0xFC2A
+#define	RTSX_SD_VPCLK1_CTL	0xFC2B
+#define	RTSX_SD_VPTX_CTL	RTSX_SD_VPCLK0_CTL
+#define	RTSX_SD_VPRX_CTL	RTSX_SD_VPCLK1_CTL
+#define	RTSX_PHASE_CHANGE	0x80
+#define	RTSX_PHASE_NOT_RESET	0x40
+#define	RTSX_PHASE_SELECT_MASK	0x1F
+#define	RTSX_PHASE_MAX		32
+
+#define	RTSX_SSC_DEPTH_4M	0x01
+#define	RTSX_SSC_DEPTH_2M	0x02
+#define	RTSX_SSC_DEPTH_1M	0x03
+#define	RTSX_SSC_DEPTH_500K	0x04
+
+#define	RTSX_MIN_DIV_N		80
+#define	RTSX_MAX_DIV_N		208
+#endif
+
 #endif
@@ -26,6 +26,14 @@
 #include <machine/bus.h>
 #endif // __APPLE__
 
+#if __APPLE__
+/* Read-back bytes kept by a batch which runs without the command engine. */
+#define RTSX_BATCH_DATA_MAX	16
+
+/* Completion wait latency buckets: < 10, 50, 100, 500 us, 1, 10 ms, more. */
+#define RTSX_WAIT_HIST_MAX	7
+#endif
+
 /* Number of registers to save for suspend/resume in terms of their ranges. */
 #define RTSX_NREG ((0XFDAE - 0XFDA0) + (0xFD69 - 0xFD32) + (0xFE34 - 0xFE20))
 
@@ -40,6 +48,27 @@ struct rtsx_softc {
 	bus_dmamap_t	dmap_adma;	/* DMA map for ADMA SG descriptors */
 	caddr_t		admabuf;	/* buffer for ADMA SG descriptors */
 	bus_dma_segment_t adma_segs[1];	/* segments for ADMA SG buffer */
+#if __APPLE__
+	caddr_t		cmdbuf;		/* host command buffer */
+	bus_dma_segment_t cmd_segs[1];	/* segments for host command buffer */
+	int		batch_open;	/* rtsx_write() queues into cmdbuf */
+	int		batch_ncmd;	/* commands queued by rtsx_batch_add() */
+	int		batch_direct;	/* batch runs as immediate accesses */
+	int		batch_error;	/* first error of a direct batch */
+	int		batch_ndata;	/* read-back bytes of a direct batch */
+	u_int8_t	batch_data[RTSX_BATCH_DATA_MAX];
+	int		wait_spin_us;	/* spin budget of the next wait */
+	int		wait_timeout_ms; /* explicit timeout of the next wait */
+	/* completion wait statistics (published by SDDisk) */
+	uint64_t	stat_spin_waits;	/* completed while spinning */
+	uint64_t	stat_sleep_waits;	/* completed after sleeping */
+	uint64_t	stat_wait_hist[RTSX_WAIT_HIST_MAX]; /* wait latency */
+	struct mutex	intr_mtx;	/* intr_status handoff */
+	int		intr_filter;	/* rtsx_intr_filter() takes interrupts */
+	volatile u_int32_t intr_deferred; /* status left for rtsx_intr_deferred() */
+	uint64_t	stat_intr_filtered;	/* completions posted by the filter */
+	uint64_t	stat_intr_deferred;	/* card events sent to the workloop */
+#endif
 	int		flags;
 	u_int32_t 	intr_status;	/* soft interrupt status */
 	u_int8_t	regs[RTSX_NREG];/* host controller state */
@@ -51,6 +80,16 @@ int	rtsx_attach(struct rtsx_softc *, bus_space_tag_t,
 	    bus_space_handle_t, bus_size_t, bus_dma_tag_t, int);
 int	rtsx_activate(struct device *, int);
 int	rtsx_intr(void *);
+#if __APPLE__
+int	rtsx_intr_filter(struct rtsx_softc *);
+int	rtsx_intr_deferred(struct rtsx_softc *);
+/* Register accesses batched through the host command queue. */
+void	rtsx_batch_init(struct rtsx_softc *);
+void	rtsx_batch_add(struct rtsx_softc *, u_int8_t, u_int16_t, u_int8_t,
+	    u_int8_t);
+int	rtsx_batch_send(struct rtsx_softc *, int);
+u_int8_t *rtsx_batch_data(struct rtsx_softc *);
+#endif
 
 /* flag values */
 #define	RTSX_F_CARD_PRESENT	0x01
@@ -63,6 +102,7 @@ int	rtsx_intr(void *);
 #define	RTSX_F_525A_TYPE_A	0x40
 #define RTSX_F_REVERSE_SOCKET	0x80
 #define RTSX_F_FORCE_CLKREQ_0	0x100
+#define RTSX_F_HOSTCMD_READY	0x200	/* command engine usable for batches */
 #endif
 
 #endif
@@ -24,6 +24,8 @@
 
 #if __APPLE__
 #include "compat/openbsd.h"
+#include <libkern/OSAtomic.h> // OSCompareAndSwap, OSCompareAndSwapPtr
+#include <kern/thread.h> // current_thread
 #else // _APPLE__
 #include <sys/param.h>
 #include <sys/device.h>
@@ -128,9 +130,16 @@ sdmmc_attach(struct device *parent, struct device *self, void *aux)
 	memcpy(&sc->sc_cookies, &saa->cookies, sizeof(sc->sc_cookies));
 
 	if (ISSET(sc->sc_caps, SMC_CAPS_DMA) && sc->sc_dmap == NULL) {
+#if __APPLE__
+		error = bus_dmamap_create(sc->sc_dmat,
+		    sc->sc_max_xfer ? sc->sc_max_xfer : MAXPHYS, SDMMC_MAXNSEGS,
+		    sc->sc_max_seg, 0, BUS_DMA_NOWAIT|BUS_DMA_ALLOCNOW,
+		    &sc->sc_dmap);
+#else
 		error = bus_dmamap_create(sc->sc_dmat, MAXPHYS, SDMMC_MAXNSEGS,
 		    sc->sc_max_seg, 0, BUS_DMA_NOWAIT|BUS_DMA_ALLOCNOW,
 		    &sc->sc_dmap);
+#endif
 		if (error) {
 			printf("%s: can't create DMA map\n", DEVNAME(sc));
 			return;
@@ -139,6 +148,10 @@ sdmmc_attach(struct device *parent, struct device *self, void *aux)
 
 	SIMPLEQ_INIT(&sc->sf_head);
 	TAILQ_INIT(&sc->sc_tskq);
+#if __APPLE__
+	sc->sc_tsk_submit = NULL;
+	mtx_init(&sc->sc_tskq_mtx, IPL_SDMMC);
+#endif
 	TAILQ_INIT(&sc->sc_intrq);
 	sdmmc_init_task(&sc->sc_discover_task, sdmmc_discover_task, sc);
 	sdmmc_init_task(&sc->sc_intr_task, sdmmc_intr_task, sc);
@@ -170,6 +183,9 @@ sdmmc_detach(struct device *self, int flags)
 		// cholonam: can't log here or will miss the wakeup()
 		tsleep_nsec(sc, PWAIT, "mmcdie", INFSLP);
 	}
+#if __APPLE__
+	mtx_destroy(&sc->sc_tskq_mtx);
+#endif
 
 	if (sc->sc_dmap)
 		bus_dmamap_destroy(sc->sc_dmat, sc->sc_dmap);
@@ -223,6 +239,25 @@ sdmmc_task_thread(void *arg)
 restart:
 	sdmmc_needs_discover(&sc->sc_dev);
 
+#if __APPLE__
+	/*
+	 * Tasks are submitted without locks, see sdmmc_add_task(). The
+	 * mutex only pairs the sleep below with the wakeup of a producer
+	 * which found the queue empty.
+	 */
+	while (!sc->sc_dying) {
+		while ((task = sdmmc_task_take(sc)) != NULL)
+			task->func(task->arg);
+		mtx_enter(&sc->sc_tskq_mtx);
+		if (!sc->sc_dying && sc->sc_tsk_submit == NULL &&
+		    sc->sc_discover_task.onqueue != SDMMC_TASK_QUEUED) {
+			msleep_nsec(&sc->sc_tskq, &sc->sc_tskq_mtx, PWAIT,
+			    "mmctsk", INFSLP);
+			sc->sc_stat_task_wakeups++;
+		}
+		mtx_leave(&sc->sc_tskq_mtx);
+	}
+#else
 	s = splsdmmc();
 	while (!sc->sc_dying) {
 		for (task = TAILQ_FIRST(&sc->sc_tskq); task != NULL;
@@ -235,6 +270,7 @@ restart:
 		tsleep_nsec(&sc->sc_tskq, PWAIT, "mmctsk", INFSLP);
 	}
 	splx(s);
+#endif
 
 	if (ISSET(sc->sc_flags, SMF_CARD_PRESENT)) {
 		rw_enter_write(&sc->sc_lock);
@@ -259,6 +295,39 @@ restart:
 void
 sdmmc_add_task(struct sdmmc_softc *sc, struct sdmmc_task *task)
 {
+#if __APPLE__
+	struct sdmmc_task *head;
+
+	task->sc = sc;
+	/* Card attach/detach has its own slot, which is looked at first. */
+	if (task == &sc->sc_discover_task) {
+		if (OSCompareAndSwap(SDMMC_TASK_IDLE, SDMMC_TASK_QUEUED,
+		    (volatile UInt32 *)&task->onqueue))
+			sdmmc_task_wakeup(sc);
+		return;
+	}
+
+	for (;;) {
+		/* Cancelled, but not taken off the queue yet: run it anyway. */
+		if (OSCompareAndSwap(SDMMC_TASK_CANCELLED, SDMMC_TASK_QUEUED,
+		    (volatile UInt32 *)&task->onqueue))
+			return;
+		if (OSCompareAndSwap(SDMMC_TASK_IDLE, SDMMC_TASK_QUEUED,
+		    (volatile UInt32 *)&task->onqueue))
+			break;
+		if (task->onqueue == SDMMC_TASK_QUEUED)
+			return;
+	}
+	do {
+		head = sc->sc_tsk_submit;
+		task->submit_next = head;
+	} while (!OSCompareAndSwapPtr(head, task,
+	    (void * volatile *)&sc->sc_tsk_submit));
+
+	/* Only an empty queue can have the task thread sleeping. */
+	if (head == NULL)
+		sdmmc_task_wakeup(sc);
+#else
 	int s;
 
 	s = splsdmmc();
@@ -267,6 +336,7 @@ sdmmc_add_task(struct sdmmc_softc *sc, struct sdmmc_task *task)
 	task->sc = sc;
 	wakeup(&sc->sc_tskq);
 	splx(s);
+#endif
 }
 
 void
@@ -278,12 +348,141 @@ sdmmc_del_task(struct sdmmc_task *task)
 	if (sc == NULL)
 		return;
 
+#if __APPLE__
+	/*
+	 * Callers may free the task as soon as this returns (SDDisk owns
+	 * bio_task_), so it must not be left linked on the submission stack
+	 * or on sc_tskq. Only the consumer may unlink it: the task thread
+	 * (or the caller, once there is no task thread) does it right here.
+	 * Any other thread marks the task cancelled and waits until
+	 * sdmmc_task_take() has dropped it. That can't take long, since the
+	 * task thread doesn't sleep while anything is queued.
+	 */
+	if (task == &sc->sc_discover_task) {
+		OSCompareAndSwap(SDMMC_TASK_QUEUED, SDMMC_TASK_IDLE,
+		    (volatile UInt32 *)&task->onqueue);
+		return;
+	}
+	if (sc->sc_task_thread == NULL ||
+	    sc->sc_task_thread == (struct proc *)current_thread()) {
+		struct sdmmc_task *t;
+
+		/* After this, every submitted task is on sc_tskq. */
+		sdmmc_task_drain(sc);
+		TAILQ_FOREACH(t, &sc->sc_tskq, next) {
+			if (t == task) {
+				TAILQ_REMOVE(&sc->sc_tskq, task, next);
+				sdmmc_task_idle(task);
+				break;
+			}
+		}
+		return;
+	}
+	mtx_enter(&sc->sc_tskq_mtx);
+	for (;;) {
+		/* sdmmc_add_task() may have revived it in the meantime. */
+		if (!OSCompareAndSwap(SDMMC_TASK_QUEUED, SDMMC_TASK_CANCELLED,
+		    (volatile UInt32 *)&task->onqueue) &&
+		    task->onqueue != SDMMC_TASK_CANCELLED)
+			break;
+		msleep_nsec(task, &sc->sc_tskq_mtx, PWAIT, "mmcdel", INFSLP);
+	}
+	mtx_leave(&sc->sc_tskq_mtx);
+#else
 	s = splsdmmc();
 	task->sc = NULL;
 	task->onqueue = 0;
 	TAILQ_REMOVE(&sc->sc_tskq, task, next);
 	splx(s);
+#endif
+}
+
+#if __APPLE__
+/* Wake up the task thread, which sleeps on an empty queue. */
+void
+sdmmc_task_wakeup(struct sdmmc_softc *sc)
+{
+	mtx_enter(&sc->sc_tskq_mtx);
+	wakeup(&sc->sc_tskq);
+	mtx_leave(&sc->sc_tskq_mtx);
+}
+
+/*
+ * Move the submission stack to sc_tskq, oldest first. Only the
+ * consumer calls this: sc_tskq is only touched by the task thread.
+ */
+void
+sdmmc_task_drain(struct sdmmc_softc *sc)
+{
+	struct sdmmc_task *task, *next, *last;
+
+	/* Take the whole stack, it's newest first. */
+	do {
+		next = sc->sc_tsk_submit;
+	} while (next != NULL && !OSCompareAndSwapPtr(next, NULL,
+	    (void * volatile *)&sc->sc_tsk_submit));
+
+	last = TAILQ_LAST(&sc->sc_tskq, sdmmc_task_list);
+	while ((task = next) != NULL) {
+		next = task->submit_next;
+		if (last != NULL)
+			TAILQ_INSERT_AFTER(&sc->sc_tskq, last, task, next);
+		else
+			TAILQ_INSERT_HEAD(&sc->sc_tskq, task, next);
+	}
+}
+
+/*
+ * Set a task which is off the queues (or about to be) IDLE, so that
+ * sdmmc_add_task() may submit it again. Returns its previous state.
+ */
+int
+sdmmc_task_idle(struct sdmmc_task *task)
+{
+	int state;
+
+	for (;;) {
+		state = task->onqueue;
+		if (OSCompareAndSwap(state, SDMMC_TASK_IDLE,
+		    (volatile UInt32 *)&task->onqueue))
+			return state;
+	}
+}
+
+/*
+ * Take the next task to run, or NULL if there is none. Only the task
+ * thread calls this. Submitted tasks are moved from the lock-free
+ * submission stack to sc_tskq, which only this thread touches.
+ */
+struct sdmmc_task *
+sdmmc_task_take(struct sdmmc_softc *sc)
+{
+	struct sdmmc_task *task;
+
+	if (OSCompareAndSwap(SDMMC_TASK_QUEUED, SDMMC_TASK_IDLE,
+	    (volatile UInt32 *)&sc->sc_discover_task.onqueue)) {
+		sc->sc_stat_tasks++;
+		return &sc->sc_discover_task;
+	}
+
+	for (;;) {
+		if (TAILQ_EMPTY(&sc->sc_tskq))
+			sdmmc_task_drain(sc);
+		if ((task = TAILQ_FIRST(&sc->sc_tskq)) == NULL)
+			return NULL;
+		TAILQ_REMOVE(&sc->sc_tskq, task, next);
+
+		if (sdmmc_task_idle(task) == SDMMC_TASK_QUEUED) {
+			sc->sc_stat_tasks++;
+			return task;
+		}
+		/* Cancelled: sdmmc_del_task() waits until we are done. */
+		mtx_enter(&sc->sc_tskq_mtx);
+		wakeup(task);
+		mtx_leave(&sc->sc_tskq_mtx);
+	}
 }
+#endif
 
 void
 sdmmc_needs_discover(struct device *self)
@@ -22,6 +22,8 @@
 #include "compat/openbsd.h"
 #include "util.h"
 extern int Sinetek_rtsx_boot_arg_mimic_linux;
+extern int Sinetek_rtsx_boot_arg_no_cmd23;
+extern int Sinetek_rtsx_boot_arg_pre_erase;
 #else
 #include <sys/param.h>
 #include <sys/device.h>
@@ -69,6 +71,23 @@ int	sdmmc_mem_single_write_block(struct sdmmc_function *, int, u_char *,
 	size_t);
 int	sdmmc_mem_write_block_subr(struct sdmmc_function *, bus_dmamap_t,
 	int, u_char *, size_t);
+#if __APPLE__
+int	sdmmc_mem_rw_block_raw(struct sdmmc_function *, int,
+	bus_dma_segment_t *, int, size_t, int);
+int	sdmmc_mem_set_block_count(struct sdmmc_function *, int);
+int	sdmmc_mem_pre_erase_wanted(struct sdmmc_function *, int);
+int	sdmmc_mem_pre_erase(struct sdmmc_function *, int);
+void	sdmmc_mem_pre_erase_account(struct sdmmc_function *, int, size_t,
+	uint64_t);
+int	sdmmc_mem_r1_ready(uint32_t);
+int	sdmmc_mem_wait_ready(struct sdmmc_function *);
+int	sdmmc_mem_send_ssr(struct sdmmc_function *, sdmmc_bitfield512_t *);
+void	sdmmc_mem_decode_ssr(struct sdmmc_function *, sdmmc_bitfield512_t *);
+int	sdmmc_mem_signal_voltage_180(struct sdmmc_softc *);
+int	sdmmc_mem_sd_uhs_select(struct sdmmc_function *, int, uint32_t *,
+	    int);
+int	sdmmc_decode_tran_speed(int, int);
+#endif
 
 #ifdef SDMMC_DEBUG
 #define DPRINTF(s)	printf s
@@ -84,11 +103,20 @@ sdmmc_mem_enable(struct sdmmc_softc *sc)
 {
 	u_int32_t host_ocr;
 	u_int32_t card_ocr;
+#if __APPLE__
+	u_int32_t resp_ocr = 0;
+	int try_uhs;
+#endif
 
 	rw_assert_wrlock(&sc->sc_lock);
 
 	/* Set host mode to SD "combo" card or SD memory-only. */
 	SET(sc->sc_flags, SMF_SD_MODE|SMF_MEM_MODE);
+#if __APPLE__
+	CLR(sc->sc_flags, SMF_UHS_MODE);
+	try_uhs = ISSET(sc->sc_caps, SMC_CAPS_UHS_MASK) &&
+	    sc->sct->signal_voltage != NULL;
+#endif
 
 	/* Reset memory (*must* do that before CMD55 or CMD1). */
 	sdmmc_go_idle_state(sc);
@@ -119,6 +147,9 @@ sdmmc_mem_enable(struct sdmmc_softc *sc)
 	}
 
 	/* Set the lowest voltage supported by the card and host. */
+#if __APPLE__
+ power_cycle:
+#endif
 	host_ocr = sdmmc_chip_host_ocr(sc->sct, sc->sch);
 	if (sdmmc_set_bus_power(sc, host_ocr, card_ocr) != 0) {
 		DPRINTF(("%s: can't supply voltage requested by card\n",
@@ -141,14 +172,158 @@ sdmmc_mem_enable(struct sdmmc_softc *sc)
 	if (sdmmc_send_if_cond(sc, card_ocr) == 0)
 		host_ocr |= SD_OCR_SDHC_CAP;
 
+#if __APPLE__
+	/* UHS-I cards only run at 1.8V signalling, ask for it (S18R). */
+	if (try_uhs && ISSET(sc->sc_flags, SMF_SD_MODE) &&
+	    ISSET(host_ocr, SD_OCR_SDHC_CAP))
+		host_ocr |= SD_OCR_S18R;
+
+	/* Send the new OCR value until all cards are ready. */
+	if (sdmmc_mem_send_op_cond(sc, host_ocr, &resp_ocr) != 0) {
+		DPRINTF(("%s: can't send memory OCR\n", DEVNAME(sc)));
+		return 1;
+	}
+
+	if (ISSET(host_ocr, SD_OCR_S18R) && ISSET(resp_ocr, SD_OCR_S18A)) {
+		if (sdmmc_mem_signal_voltage_180(sc) == 0) {
+			SET(sc->sc_flags, SMF_UHS_MODE);
+			return 0;
+		}
+
+		/*
+		 * The card may be left halfway through the switch, with
+		 * CMD and DAT held low. Only a power cycle gets it back to
+		 * 3.3V; initialize it again without asking for 1.8V.
+		 */
+		UTL_ERR("%s: 1.8V signal voltage switch failed, using 3.3V",
+		    DEVNAME(sc));
+		sc->sc_stat_uhs_fallbacks++;
+		try_uhs = 0;
+		(void)sdmmc_chip_bus_clock(sc->sct, sc->sch,
+		    SDMMC_SDCLK_OFF, SDMMC_TIMING_LEGACY);
+		(void)sdmmc_chip_bus_power(sc->sct, sc->sch, 0);
+		sdmmc_delay(10000);
+		if (sdmmc_chip_bus_clock(sc->sct, sc->sch,
+		    SDMMC_SDCLK_400KHZ, SDMMC_TIMING_LEGACY) != 0)
+			return 1;
+		goto power_cycle;
+	}
+#else
 	/* Send the new OCR value until all cards are ready. */
 	if (sdmmc_mem_send_op_cond(sc, host_ocr, NULL) != 0) {
 		DPRINTF(("%s: can't send memory OCR\n", DEVNAME(sc)));
 		return 1;
 	}
+#endif
 	return 0;
 }
 
+#if __APPLE__
+/*
+ * Switch the card and the host to 1.8V signalling (CMD11), after the card
+ * accepted it in its ACMD41 response.
+ */
+int
+sdmmc_mem_signal_voltage_180(struct sdmmc_softc *sc)
+{
+	struct sdmmc_command cmd;
+	int error;
+
+	bzero(&cmd, sizeof cmd);
+	cmd.c_opcode = SD_VOLTAGE_SWITCH;
+	cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1;
+	error = sdmmc_mmc_command(sc, &cmd);
+	if (error)
+		return error;
+
+	return sdmmc_chip_signal_voltage(sc->sct, sc->sch,
+	    SDMMC_SIGNAL_VOLTAGE_180);
+}
+
+/*
+ * UHS-I access modes, fastest first. DDR50 moves as much data as SDR50 at
+ * half the clock and without tuning, so it goes before SDR50 (like Linux).
+ */
+static const struct sdmmc_uhs_mode {
+	int		func;		/* CMD6 group 1 function */
+	u_int32_t	cap;		/* SMC_CAPS_UHS_* */
+	int		freq;		/* SDMMC_SDCLK_* */
+	int		timing;		/* SDMMC_TIMING_UHS_* */
+	const char	*name;
+} sdmmc_uhs_modes[] = {
+	{ SD_ACCESS_MODE_SDR104, SMC_CAPS_UHS_SDR104, SDMMC_SDCLK_208MHZ,
+	  SDMMC_TIMING_UHS_SDR104, "SDR104" },
+	{ SD_ACCESS_MODE_DDR50, SMC_CAPS_UHS_DDR50, SDMMC_SDCLK_50MHZ,
+	  SDMMC_TIMING_UHS_DDR50, "DDR50" },
+	{ SD_ACCESS_MODE_SDR50, SMC_CAPS_UHS_SDR50, SDMMC_SDCLK_100MHZ,
+	  SDMMC_TIMING_UHS_SDR50, "SDR50" },
+};
+
+/*
+ * Select the fastest UHS-I mode supported by both the card and the host
+ * which passes tuning and reads the SCR back unchanged. A failed mode
+ * slows the bus down again so that the next CMD6 gets through.
+ */
+int
+sdmmc_mem_sd_uhs_select(struct sdmmc_function *sf, int support_func,
+    uint32_t *raw_scr, int default_clock)
+{
+	struct sdmmc_softc *sc = sf->sc;
+	const struct sdmmc_uhs_mode *m;
+	sdmmc_bitfield512_t status;
+	uint32_t check_scr[2];
+	int i, error = ENOTSUP;
+
+	for (i = 0; i < nitems(sdmmc_uhs_modes); i++) {
+		m = &sdmmc_uhs_modes[i];
+		if (!ISSET(sc->sc_caps, m->cap) ||
+		    !(support_func & (1 << m->func)))
+			continue;
+
+		error = sdmmc_mem_sd_switch(sf, 1, 1, m->func, &status);
+		if (error) {
+			UTL_ERR("%s: can't switch to %s (%d)", DEVNAME(sc),
+			    m->name, error);
+			continue;
+		}
+		/* Wait 400KHz x 8 clock (2.5us * 8 + slop) */
+		delay(25);
+
+		if (SFUNC_STATUS_SELECTED(&status, 1) != m->func) {
+			UTL_ERR("%s: card refused %s", DEVNAME(sc), m->name);
+			error = ENOTSUP;
+			continue;
+		}
+
+		error = sdmmc_chip_bus_clock(sc->sct, sc->sch, m->freq,
+		    m->timing);
+		if (error == 0)
+			error = sc->sct->execute_tuning == NULL ? ENOTSUP :
+			    sdmmc_chip_execute_tuning(sc->sct, sc->sch,
+			    m->timing);
+		if (error == 0)
+			error = sdmmc_mem_send_scr(sc, check_scr);
+		if (error == 0 && memcmp(check_scr, raw_scr,
+		    sizeof(check_scr)) != 0)
+			error = EIO;
+		if (error == 0) {
+			sf->timing = m->timing;
+			sf->clock = m->freq;
+			UTL_LOG("%s: UHS-I %s mode", DEVNAME(sc), m->name);
+			return 0;
+		}
+
+		UTL_ERR("%s: %s mode failed (%d)", DEVNAME(sc), m->name,
+		    error);
+		sc->sc_stat_uhs_fallbacks++;
+		(void)sdmmc_chip_bus_clock(sc->sct, sc->sch,
+		    default_clock, SDMMC_TIMING_LEGACY);
+	}
+
+	return error;
+}
+#endif
+
 /*
  * Read the CSD and CID from all cards and assign each card a unique
  * relative card address (RCA).  CMD2 is ignored by SDIO-only cards.
@@ -291,6 +466,10 @@ sdmmc_decode_csd(struct sdmmc_softc *sc, sdmmc_response resp,
 			break;
 		}
 		csd->ccc = SD_CSD_CCC(resp);
+#if __APPLE__
+		csd->tran_speed = sdmmc_decode_tran_speed(SD_CSD_SPEED(resp),
+		    0);
+#endif
 	} else {
 		csd->csdver = MMC_CSD_CSDVER(resp);
 		if (csd->csdver == MMC_CSD_CSDVER_1_0 ||
@@ -299,6 +478,10 @@ sdmmc_decode_csd(struct sdmmc_softc *sc, sdmmc_response resp,
 			csd->mmcver = MMC_CSD_MMCVER(resp);
 			csd->capacity = MMC_CSD_CAPACITY(resp);
 			csd->read_bl_len = MMC_CSD_READ_BL_LEN(resp);
+#if __APPLE__
+			csd->tran_speed = sdmmc_decode_tran_speed(
+			    MMC_CSD_TRAN_SPEED(resp), 1);
+#endif
 		} else {
 			printf("%s: unknown MMC CSD structure version 0x%x\n",
 			    DEVNAME(sc), csd->csdver);
@@ -314,6 +497,29 @@ sdmmc_decode_csd(struct sdmmc_softc *sc, sdmmc_response resp,
 	return 0;
 }
 
+#if __APPLE__
+/*
+ * Decode the CSD TRAN_SPEED field into kHz.  The MMC table differs from
+ * the SD one in two places so that 26 and 52 MHz can be expressed.
+ */
+int
+sdmmc_decode_tran_speed(int code, int mmc)
+{
+	static const int unit[] = { 100, 1000, 10000, 100000 };
+	static const int sd_mult[] = {
+		0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+	};
+	static const int mmc_mult[] = {
+		0, 10, 12, 13, 15, 20, 26, 30, 35, 40, 45, 52, 55, 60, 70, 80
+	};
+	int u = code & 0x7, m = (code >> 3) & 0xf;
+
+	if (u >= nitems(unit))
+		return 0;
+	return unit[u] * (mmc ? mmc_mult[m] : sd_mult[m]) / 10;
+}
+#endif
+
 int
 sdmmc_decode_cid(struct sdmmc_softc *sc, sdmmc_response resp,
     struct sdmmc_function *sf)
@@ -414,6 +620,15 @@ sdmmc_mem_decode_scr(struct sdmmc_softc *sc, uint32_t *raw_scr,
 	ver = SCR_STRUCTURE(resp);
 	sf->scr.sd_spec = SCR_SD_SPEC(resp);
 	sf->scr.bus_width = SCR_SD_BUS_WIDTHS(resp);
+#if __APPLE__
+	sf->scr.cmd23 = SCR_CMD_SUPPORT_CMD23(resp);
+	sf->scr.sd_spec3 = SCR_SD_SPEC3(resp);
+	sf->scr.sd_specx = SCR_SD_SPECX(resp);
+	if (sf->scr.cmd23 && !Sinetek_rtsx_boot_arg_no_cmd23)
+		SET(sf->flags, SFF_CMD23);
+	else
+		CLR(sf->flags, SFF_CMD23);
+#endif
 
 	DPRINTF(("%s: %s: %08x%08x ver=%d, spec=%d, bus width=%d\n",
 	    DEVNAME(sc), __func__, resp[1], resp[0],
@@ -605,6 +820,9 @@ sdmmc_mem_sd_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 	int support_func, best_func, error;
 	sdmmc_bitfield512_t status; /* Switch Function Status */
 	uint32_t raw_scr[2];
+#if __APPLE__
+	int default_clock;
+#endif
 
 	/*
 	 * All SD cards are supposed to support Default Speed mode
@@ -613,8 +831,17 @@ sdmmc_mem_sd_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 	 * RTS5229 host controller if it is running at a low clock
 	 * frequency.  Reading the SCR requires a data transfer.
 	 */
+#if __APPLE__
+	/* Cards may advertise less than 25 MHz in TRAN_SPEED. */
+	default_clock = SDMMC_SDCLK_25MHZ;
+	if (sf->csd.tran_speed != 0 && sf->csd.tran_speed < default_clock)
+		default_clock = sf->csd.tran_speed;
+	error = sdmmc_chip_bus_clock(sc->sct, sc->sch, default_clock,
+	    SDMMC_TIMING_LEGACY);
+#else
 	error = sdmmc_chip_bus_clock(sc->sct, sc->sch, SDMMC_SDCLK_25MHZ,
 	    SDMMC_TIMING_LEGACY);
+#endif
 	if (error) {
 		printf("%s: can't change bus clock\n", DEVNAME(sc));
 		return error;
@@ -646,6 +873,21 @@ sdmmc_mem_sd_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 		}
 	}
 
+#if __APPLE__
+	/* Pre-erase is measured per card (0: never, 2: always). */
+	bzero(&sf->pre_erase, sizeof(sf->pre_erase));
+	sf->pre_erase.state = Sinetek_rtsx_boot_arg_pre_erase == 0 ?
+	    SDMMC_PRE_ERASE_OFF : Sinetek_rtsx_boot_arg_pre_erase == 2 ?
+	    SDMMC_PRE_ERASE_ON : SDMMC_PRE_ERASE_PROBING;
+
+	/* The SD Status is only needed for erase/AU tuning, go on without it. */
+	bzero(&sf->ssr, sizeof(sf->ssr));
+	if (sdmmc_mem_send_ssr(sf, &status) == 0)
+		sdmmc_mem_decode_ssr(sf, &status);
+	else
+		UTL_ERR("%s: SD_APP_SD_STATUS failed", DEVNAME(sc));
+#endif
+
 	best_func = 0;
 	if (sf->scr.sd_spec >= SCR_SD_SPEC_VER_1_10 &&
 	    ISSET(sf->csd.ccc, SD_CSD_CCC_SWITCH)) {
@@ -665,6 +907,11 @@ sdmmc_mem_sd_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 			      (support_func & (1 << SD_ACCESS_MODE_SDR50 )) ? " SDR50" : "",
 			      (support_func & (1 << SD_ACCESS_MODE_SDR104)) ? " SDR104" : "",
 			      (support_func & (1 << SD_ACCESS_MODE_DDR50 )) ? " DDR50" : "");
+		/* UHS-I modes need 1.8V signalling (see sdmmc_mem_enable). */
+		if (ISSET(sc->sc_flags, SMF_UHS_MODE) &&
+		    sdmmc_mem_sd_uhs_select(sf, support_func, raw_scr,
+		    default_clock) == 0)
+			return 0;
 #endif
 		if (support_func & (1 << SD_ACCESS_MODE_SDR25))
 			best_func = 1;
@@ -685,6 +932,17 @@ sdmmc_mem_sd_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 		/* Wait 400KHz x 8 clock (2.5us * 8 + slop) */
 		delay(25);
 
+#if __APPLE__
+		/* The card may refuse the switch, e.g. over power limits. */
+		if (SFUNC_STATUS_SELECTED(&status, 1) != best_func) {
+			UTL_ERR("%s: card stayed in function %d", DEVNAME(sc),
+			    SFUNC_STATUS_SELECTED(&status, 1));
+			sf->timing = SDMMC_TIMING_LEGACY;
+			sf->clock = default_clock;
+			return 0;
+		}
+#endif
+
 		/* High Speed mode, Frequency up to 50MHz. */
 		error = sdmmc_chip_bus_clock(sc->sct, sc->sch,
 		    SDMMC_SDCLK_50MHZ, SDMMC_TIMING_HIGHSPEED);
@@ -692,7 +950,17 @@ sdmmc_mem_sd_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 			printf("%s: can't change bus clock\n", DEVNAME(sc));
 			return error;
 		}
+#if __APPLE__
+		sf->timing = SDMMC_TIMING_HIGHSPEED;
+		sf->clock = SDMMC_SDCLK_50MHZ;
+#endif
 	}
+#if __APPLE__
+	else {
+		sf->timing = SDMMC_TIMING_LEGACY;
+		sf->clock = default_clock;
+	}
+#endif
 
 	return 0;
 }
@@ -708,6 +976,11 @@ sdmmc_mem_mmc_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 	int timing = SDMMC_TIMING_LEGACY;
 	u_int32_t sectors = 0;
 
+#if __APPLE__
+	/* Legacy MMC timing allows up to 26 MHz, as given by TRAN_SPEED. */
+	if (sf->csd.tran_speed != 0 && sf->csd.tran_speed <= 26000)
+		speed = sf->csd.tran_speed;
+#endif
 	error = sdmmc_chip_bus_clock(sc->sct, sc->sch, speed, timing);
 	if (error) {
 		printf("%s: can't change bus clock\n", DEVNAME(sc));
@@ -802,6 +1075,10 @@ sdmmc_mem_mmc_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 		}
 
 		if (timing == SDMMC_TIMING_MMC_DDR52) {
+#if __APPLE__
+			int sdr_value = value;
+
+#endif
 			switch (width) {
 			case 4:
 				value = EXT_CSD_BUS_WIDTH_4_DDR;
@@ -821,6 +1098,39 @@ sdmmc_mem_mmc_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 
 			sdmmc_delay(10000);
 
+#if __APPLE__
+			/*
+			 * DDR52 is also rated at 3V I/O, and the SD socket
+			 * feeds VCCQ from VCC: stay at 3.3V. Check the data
+			 * path with EXT_CSD and go back to High Speed if the
+			 * host can't sample it.
+			 */
+			error = sdmmc_chip_bus_clock(sc->sct, sc->sch, speed,
+			    timing);
+			if (error == 0 && sc->sct->execute_tuning != NULL)
+				error = sdmmc_chip_execute_tuning(sc->sct,
+				    sc->sch, timing);
+			if (error == 0)
+				error = sdmmc_mem_send_cxd_data(sc,
+				    MMC_SEND_EXT_CSD, ext_csd, sizeof(ext_csd));
+			if (error) {
+				UTL_ERR("%s: DDR52 failed (%d), using High"
+				    " Speed", DEVNAME(sc), error);
+				timing = SDMMC_TIMING_HIGHSPEED;
+				error = sdmmc_chip_bus_clock(sc->sct, sc->sch,
+				    speed, timing);
+				if (error == 0)
+					error = sdmmc_mem_mmc_switch(sf,
+					    EXT_CSD_CMD_SET_NORMAL,
+					    EXT_CSD_BUS_WIDTH, sdr_value);
+				if (error) {
+					printf("%s: can't switch back to SDR\n",
+					    DEVNAME(sc));
+					return error;
+				}
+			}
+			sdmmc_delay(10000);
+#else
 			error = sdmmc_chip_signal_voltage(sc->sct, sc->sch,
 			    SDMMC_SIGNAL_VOLTAGE_180);
 			if (error) {
@@ -836,6 +1146,7 @@ sdmmc_mem_mmc_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 			}
 
 			sdmmc_delay(10000);
+#endif
 		}
 
 		sectors = ext_csd[EXT_CSD_SEC_COUNT + 0] << 0 |
@@ -849,6 +1160,10 @@ sdmmc_mem_mmc_init(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 		}
 	}
 
+#if __APPLE__
+	sf->timing = timing;
+	sf->clock = speed;
+#endif
 	return error;
 }
 
@@ -923,6 +1238,188 @@ sdmmc_mem_set_blocklen(struct sdmmc_softc *sc, struct sdmmc_function *sf)
 	return sdmmc_mmc_command(sc, &cmd);
 }
 
+#if __APPLE__
+/* Upper bound for a card to get back to the transfer state after a block
+ * transfer (the SD spec allows up to 500 ms of busy time for a write). */
+#define SDMMC_MEM_READY_TIMEOUT_MS	1000
+
+int
+sdmmc_mem_r1_ready(uint32_t r1)
+{
+	int state = MMC_R1_CURRENT_STATE(r1);
+
+	/* The state is the one the card was in when the command arrived;
+	 * STOP_TRANSMISSION during a read moves it from data to transfer. */
+	return ISSET(r1, MMC_R1_READY_FOR_DATA) &&
+	    (state == MMC_R1_STATE_TRAN || state == MMC_R1_STATE_DATA);
+}
+
+/*
+ * Poll SEND_STATUS until the card is ready for data, for no longer than
+ * SDMMC_MEM_READY_TIMEOUT_MS.
+ */
+int
+sdmmc_mem_wait_ready(struct sdmmc_function *sf)
+{
+	struct sdmmc_softc *sc = sf->sc;
+	struct sdmmc_command cmd;
+	uint64_t deadline;
+	int error;
+
+	nanoseconds_to_absolutetime(
+	    (uint64_t) SDMMC_MEM_READY_TIMEOUT_MS * 1000000, &deadline);
+	deadline += mach_absolute_time();
+	for (;;) {
+		bzero(&cmd, sizeof cmd);
+		cmd.c_opcode = MMC_SEND_STATUS;
+		cmd.c_arg = MMC_ARG_RCA(sf->rca);
+		cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1;
+		error = sdmmc_mmc_command(sc, &cmd);
+		sc->sc_stat_xfer_cmds++;
+		sc->sc_stat_status_polls++;
+		if (error != 0)
+			return error;
+		if (ISSET(MMC_R1(cmd.c_resp), MMC_R1_READY_FOR_DATA))
+			return 0;
+		if (mach_absolute_time() > deadline) {
+			UTL_ERR("%s: card not ready after %d ms (status 0x%08x)",
+			    DEVNAME(sc), SDMMC_MEM_READY_TIMEOUT_MS,
+			    MMC_R1(cmd.c_resp));
+			return ETIMEDOUT;
+		}
+		/* still programming: do not hog the controller */
+		IOSleep(1);
+	}
+}
+
+/*
+ * Announce the length of the next multiple block transfer with CMD23, so
+ * that the card leaves the data state by itself and no STOP_TRANSMISSION is
+ * needed.  Returns 0 if the transfer must be ended with CMD12 instead.  A card
+ * that does not accept CMD23 is not asked again.
+ */
+int
+sdmmc_mem_set_block_count(struct sdmmc_function *sf, int nblks)
+{
+	struct sdmmc_softc *sc = sf->sc;
+	struct sdmmc_command cmd;
+	int error;
+
+	if (!ISSET(sf->flags, SFF_CMD23) || nblks <= 1)
+		return 0;
+
+	bzero(&cmd, sizeof cmd);
+	cmd.c_opcode = MMC_SET_BLOCK_COUNT;
+	cmd.c_arg = nblks;
+	cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1;
+	error = sdmmc_mmc_command(sc, &cmd);
+	sc->sc_stat_xfer_cmds++;
+	if (error != 0) {
+		UTL_ERR("%s: CMD23 failed (error %d), falling back to CMD12",
+		    DEVNAME(sc), error);
+		CLR(sf->flags, SFF_CMD23);
+		sc->sc_stat_cmd23_errors++;
+		return 0;
+	}
+	sc->sc_stat_cmd23++;
+	return 1;
+}
+
+/* Writes shorter than this are not measured (nor pre-erased while probing). */
+#define SDMMC_PRE_ERASE_MIN_BLKS	128
+/* Writes measured with and without pre-erase before deciding. */
+#define SDMMC_PRE_ERASE_SAMPLES		32
+/* Pre-erase is kept if it is at least this much faster (percent). */
+#define SDMMC_PRE_ERASE_MIN_GAIN	5
+
+/*
+ * Whether the next write of nblks blocks should be preceded by ACMD23.
+ * While probing, the measured writes alternate between both methods.
+ */
+int
+sdmmc_mem_pre_erase_wanted(struct sdmmc_function *sf, int nblks)
+{
+	struct sdmmc_pre_erase *pe = &sf->pre_erase;
+
+	if (nblks <= 1)
+		return 0;
+	switch (pe->state) {
+	case SDMMC_PRE_ERASE_ON:
+		return 1;
+	case SDMMC_PRE_ERASE_PROBING:
+		return nblks >= SDMMC_PRE_ERASE_MIN_BLKS &&
+		    pe->samples[1] < pe->samples[0];
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Tell the card how many blocks the next multiple block write has, so that
+ * it can erase them beforehand.  A card that rejects ACMD23 is not asked
+ * again.  Returns 1 if the command was accepted.
+ */
+int
+sdmmc_mem_pre_erase(struct sdmmc_function *sf, int nblks)
+{
+	struct sdmmc_softc *sc = sf->sc;
+	struct sdmmc_command cmd;
+	int error;
+
+	bzero(&cmd, sizeof cmd);
+	cmd.c_opcode = SD_APP_SET_WR_BLK_ERASE_COUNT;
+	cmd.c_arg = nblks & 0x7fffff;
+	cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1;
+	error = sdmmc_app_command(sc, &cmd);
+	sc->sc_stat_xfer_cmds += 2;
+	if (error != 0) {
+		UTL_ERR("%s: ACMD23 failed (error %d), pre-erase disabled",
+		    DEVNAME(sc), error);
+		sf->pre_erase.state = SDMMC_PRE_ERASE_OFF;
+		return 0;
+	}
+	sc->sc_stat_pre_erase++;
+	return 1;
+}
+
+/*
+ * Account a successful write which started at 'start' (mach_absolute_time())
+ * while probing.  Once enough writes have been measured both ways, pre-erase
+ * is enabled for good if it made writes faster, and disabled otherwise.
+ */
+void
+sdmmc_mem_pre_erase_account(struct sdmmc_function *sf, int pre_erased,
+    size_t datalen, uint64_t start)
+{
+	struct sdmmc_pre_erase *pe = &sf->pre_erase;
+	uint64_t nsecs;
+	int i;
+
+	if (pe->state != SDMMC_PRE_ERASE_PROBING ||
+	    datalen < SDMMC_PRE_ERASE_MIN_BLKS * sf->csd.sector_size)
+		return;
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &nsecs);
+	i = pre_erased ? 1 : 0;
+	pe->samples[i]++;
+	pe->bytes[i] += datalen;
+	pe->nsecs[i] += nsecs;
+	if (pe->samples[0] < SDMMC_PRE_ERASE_SAMPLES ||
+	    pe->samples[1] < SDMMC_PRE_ERASE_SAMPLES)
+		return;
+
+	for (i = 0; i < 2; i++)
+		pe->rate[i] = pe->nsecs[i] ?
+		    pe->bytes[i] * 1000000000ULL / 1024 / pe->nsecs[i] : 0;
+	pe->state = pe->rate[1] * 100 >=
+	    pe->rate[0] * (100 + SDMMC_PRE_ERASE_MIN_GAIN) ?
+	    SDMMC_PRE_ERASE_ON : SDMMC_PRE_ERASE_OFF;
+	UTL_LOG("%s: writes %llu KiB/s with pre-erase, %llu KiB/s without:"
+	    " pre-erase %s", DEVNAME(sf->sc), pe->rate[1], pe->rate[0],
+	    pe->state == SDMMC_PRE_ERASE_ON ? "enabled" : "disabled");
+}
+#endif
+
 int
 sdmmc_mem_read_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
     int blkno, u_char *data, size_t datalen)
@@ -930,11 +1427,20 @@ sdmmc_mem_read_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
 	struct sdmmc_softc *sc = sf->sc;
 	struct sdmmc_command cmd;
 	int error;
+#if __APPLE__
+	int predefined;
+#endif
 
 
 	if ((error = sdmmc_select_card(sc, sf)) != 0)
 		goto err;
 
+#if __APPLE__
+	sc->sc_stat_xfers++;
+	predefined = sdmmc_mem_set_block_count(sf,
+	    datalen / sf->csd.sector_size);
+#endif
+
 	bzero(&cmd, sizeof cmd);
 	cmd.c_data = data;
 	cmd.c_datalen = datalen;
@@ -950,6 +1456,7 @@ sdmmc_mem_read_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
 
 	error = sdmmc_mmc_command(sc, &cmd);
 #if __APPLE__
+	sc->sc_stat_xfer_cmds++;
 	if (!Sinetek_rtsx_boot_arg_mimic_linux) {
 		// Linux always sends the STOP_TRANSMISSION command
 		if (error != 0)
@@ -961,16 +1468,35 @@ sdmmc_mem_read_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
 #endif
 
 	if (ISSET(sc->sc_flags, SMF_STOP_AFTER_MULTIPLE) &&
+#if __APPLE__
+	    /* a failed CMD23 transfer may still have to be stopped */
+	    (!predefined || error != 0) &&
+#endif
 	    cmd.c_opcode == MMC_READ_BLOCK_MULTIPLE) {
 		bzero(&cmd, sizeof cmd);
 		cmd.c_opcode = MMC_STOP_TRANSMISSION;
 		cmd.c_arg = MMC_ARG_RCA(sf->rca);
 		cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1B;
 		error = sdmmc_mmc_command(sc, &cmd);
+#if __APPLE__
+		sc->sc_stat_xfer_cmds++;
+		sc->sc_stat_cmd12++;
+#endif
 		if (error != 0)
 			goto err;
 	}
 
+#if __APPLE__
+	/*
+	 * A read leaves the card in the transfer state as soon as the R1b
+	 * STOP_TRANSMISSION (or the last block of a CMD23 transfer) is done,
+	 * so only ask for the status if the last response does not show it.
+	 */
+	if (error != 0 || !sdmmc_mem_r1_ready(MMC_R1(cmd.c_resp)))
+		error = sdmmc_mem_wait_ready(sf);
+	else
+		sc->sc_stat_status_skipped++;
+#else
 	do {
 		bzero(&cmd, sizeof cmd);
 		cmd.c_opcode = MMC_SEND_STATUS;
@@ -981,6 +1507,7 @@ sdmmc_mem_read_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
 			break;
 		/* XXX time out */
 	} while (!ISSET(MMC_R1(cmd.c_resp), MMC_R1_READY_FOR_DATA));
+#endif
 
 err:
 	return (error);
@@ -1056,23 +1583,19 @@ sdmmc_mem_write_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
 	int error;
 #if __APPLE__
 	int wr_error = 0;
+	int predefined = 0;
+	int pre_erased = 0;
+	uint64_t start;
 #endif
 
 	if ((error = sdmmc_select_card(sc, sf)) != 0)
 		goto err;
 
-#if __APPLE__ && RTSX_USE_PRE_ERASE_BLK
-	// PRE-ERASE BLOCKS (this should make writes faster)
-	if (Sinetek_rtsx_boot_arg_mimic_linux && datalen / cmd.c_blklen > 1) {
-		struct sdmmc_command pre_erase_cmd = {};
-		pre_erase_cmd.c_opcode = 23;
-		pre_erase_cmd.c_arg = datalen >> 9;
-		pre_erase_cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1;
-		error = sdmmc_app_command(sc, &pre_erase_cmd);
-		if (error) {
-			UTL_ERR("Failed to send pre-erase command (error = %d)", error);
-		}
-	}
+#if __APPLE__
+	start = mach_absolute_time();
+	if (sdmmc_mem_pre_erase_wanted(sf, datalen / sf->csd.sector_size))
+		pre_erased = sdmmc_mem_pre_erase(sf,
+		    datalen / sf->csd.sector_size);
 #endif
 
 	bzero(&cmd, sizeof cmd);
@@ -1088,8 +1611,13 @@ sdmmc_mem_write_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
 	cmd.c_flags = SCF_CMD_ADTC | SCF_RSP_R1;
 	cmd.c_dmamap = dmap;
 
+#if __APPLE__
+	sc->sc_stat_xfers++;
+	predefined = sdmmc_mem_set_block_count(sf, datalen / cmd.c_blklen);
+#endif
 	error = sdmmc_mmc_command(sc, &cmd);
 #if __APPLE__
+	sc->sc_stat_xfer_cmds++;
 	wr_error = error; // save error
 #else
 	if (error != 0)
@@ -1097,15 +1625,37 @@ sdmmc_mem_write_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
 #endif
 
 	if (ISSET(sc->sc_flags, SMF_STOP_AFTER_MULTIPLE) &&
+#if __APPLE__
+	    (!predefined || wr_error != 0) &&
+#endif
 	    cmd.c_opcode == MMC_WRITE_BLOCK_MULTIPLE) {
 		bzero(&cmd, sizeof cmd);
 		cmd.c_opcode = MMC_STOP_TRANSMISSION;
 		cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1B;
 		error = sdmmc_mmc_command(sc, &cmd);
+#if __APPLE__
+		sc->sc_stat_xfer_cmds++;
+		sc->sc_stat_cmd12++;
+#endif
 		if (error != 0)
 			goto err;
 	}
 
+#if __APPLE__
+	/*
+	 * If the host waits for the card to release DAT0, the data transfer
+	 * (or the R1b STOP_TRANSMISSION) only completes once the card is done
+	 * programming, and there is nothing left to poll for.
+	 */
+	if (error != 0 || wr_error != 0 ||
+	    !ISSET(sc->sc_caps, SMC_CAPS_WAIT_BUSY_END))
+		error = sdmmc_mem_wait_ready(sf);
+	else
+		sc->sc_stat_status_skipped++;
+
+	if (error == 0 && wr_error == 0)
+		sdmmc_mem_pre_erase_account(sf, pre_erased, datalen, start);
+#else
 	do {
 		bzero(&cmd, sizeof cmd);
 		cmd.c_opcode = MMC_SEND_STATUS;
@@ -1116,6 +1666,7 @@ sdmmc_mem_write_block_subr(struct sdmmc_function *sf, bus_dmamap_t dmap,
 			break;
 		/* XXX time out */
 	} while (!ISSET(MMC_R1(cmd.c_resp), MMC_R1_READY_FOR_DATA));
+#endif
 
 err:
 #if __APPLE__
@@ -1187,6 +1738,202 @@ out:
 	return (error);
 }
 
+#if __APPLE__
+/*
+ * Zero-copy variants of sdmmc_mem_read_block()/sdmmc_mem_write_block(): the
+ * caller passes the scatter/gather list of its own (wired) buffer instead of
+ * a kernel virtual address, so no bounce buffer is needed.  Returns ENOTSUP
+ * if the host cannot do multi-segment DMA, so that the caller can fall back
+ * to the bounce path.
+ */
+int
+sdmmc_mem_rw_block_raw(struct sdmmc_function *sf, int blkno,
+    bus_dma_segment_t *segs, int nsegs, size_t datalen, int read)
+{
+	struct sdmmc_softc *sc = sf->sc;
+	int error;
+
+	if (ISSET(sc->sc_caps, SMC_CAPS_SINGLE_ONLY) ||
+	    !ISSET(sc->sc_caps, SMC_CAPS_DMA))
+		return ENOTSUP;
+
+	rw_enter_write(&sc->sc_lock);
+
+	error = bus_dmamap_load_raw(sc->sc_dmat, sc->sc_dmap, segs, nsegs,
+	    datalen, BUS_DMA_NOWAIT | (read ? BUS_DMA_READ : BUS_DMA_WRITE));
+	if (error)
+		goto out;
+
+	bus_dmamap_sync(sc->sc_dmat, sc->sc_dmap, 0, datalen,
+	    read ? BUS_DMASYNC_PREREAD : BUS_DMASYNC_PREWRITE);
+
+	if (read)
+		error = sdmmc_mem_read_block_subr(sf, sc->sc_dmap, blkno,
+		    NULL, datalen);
+	else
+		error = sdmmc_mem_write_block_subr(sf, sc->sc_dmap, blkno,
+		    NULL, datalen);
+	if (error)
+		goto unload;
+
+	bus_dmamap_sync(sc->sc_dmat, sc->sc_dmap, 0, datalen,
+	    read ? BUS_DMASYNC_POSTREAD : BUS_DMASYNC_POSTWRITE);
+unload:
+	bus_dmamap_unload(sc->sc_dmat, sc->sc_dmap);
+
+out:
+	rw_exit(&sc->sc_lock);
+	return (error);
+}
+
+int
+sdmmc_mem_read_block_raw(struct sdmmc_function *sf, int blkno,
+    bus_dma_segment_t *segs, int nsegs, size_t datalen)
+{
+	return sdmmc_mem_rw_block_raw(sf, blkno, segs, nsegs, datalen, 1);
+}
+
+int
+sdmmc_mem_write_block_raw(struct sdmmc_function *sf, int blkno,
+    bus_dma_segment_t *segs, int nsegs, size_t datalen)
+{
+	return sdmmc_mem_rw_block_raw(sf, blkno, segs, nsegs, datalen, 0);
+}
+
+int
+sdmmc_mem_send_ssr(struct sdmmc_function *sf, sdmmc_bitfield512_t *ssr)
+{
+	struct sdmmc_softc *sc = sf->sc;
+	struct sdmmc_command cmd;
+	void *ptr = NULL;
+	const int statlen = 64;
+	int error = 0;
+
+	ptr = malloc(statlen, M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (ptr == NULL)
+		return ENOMEM;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.c_data = ptr;
+	cmd.c_datalen = statlen;
+	cmd.c_blklen = statlen;
+	cmd.c_arg = 0;
+	cmd.c_flags = SCF_CMD_ADTC | SCF_CMD_READ | SCF_RSP_R1;
+	cmd.c_opcode = SD_APP_SD_STATUS;
+
+	error = sdmmc_app_command(sc, &cmd);
+	if (error == 0) {
+		memcpy(ssr, ptr, statlen);
+		sdmmc_be512_to_bitfield512(ssr);
+	}
+
+	free(ptr, M_DEVBUF, statlen);
+	return error;
+}
+
+void
+sdmmc_mem_decode_ssr(struct sdmmc_function *sf, sdmmc_bitfield512_t *ssr)
+{
+	/* AU sizes in sectors (0xB and up were added by the SDXC spec.) */
+	static const int au_sizes[16] = {
+		0, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192,
+		16384, 24576, 32768, 49152, 65536, 131072
+	};
+	int au, es, et;
+
+	au = SSR_AU_SIZE(ssr);
+	if (au != 0 && (au <= 9 || sf->scr.sd_spec3)) {
+		sf->ssr.au_size = au_sizes[au];
+		es = SSR_ERASE_SIZE(ssr);
+		et = SSR_ERASE_TIMEOUT(ssr);
+		if (es != 0 && et != 0) {
+			sf->ssr.erase_timeout = (et * 1000) / es;
+			sf->ssr.erase_offset = SSR_ERASE_OFFSET(ssr) * 1000;
+		}
+	}
+	sf->ssr.discard = sf->scr.sd_specx && SSR_DISCARD_SUPPORT(ssr);
+
+	UTL_LOG("%s: AU %d KiB, erase timeout %d ms/AU + %d ms%s",
+	    DEVNAME(sf->sc), sf->ssr.au_size / 2, sf->ssr.erase_timeout,
+	    sf->ssr.erase_offset, sf->ssr.discard ? ", discard" : "");
+}
+
+int
+sdmmc_mem_can_erase(struct sdmmc_function *sf)
+{
+	return ISSET(sf->sc->sc_flags, SMF_SD_MODE) &&
+	    ISSET(sf->csd.ccc, SD_CSD_CCC_ERACE);
+}
+
+/*
+ * Erase blocks [blkno, blkno + nblks) with ERASE_WR_BLK_START/END and
+ * ERASE, using the DISCARD argument if the card supports it.  The busy
+ * timeout of the ERASE is computed from the SD Status erase fields, like
+ * Linux does (250 ms per AU if they are not given, at least 1 s).
+ */
+int
+sdmmc_mem_erase(struct sdmmc_function *sf, int blkno, int nblks)
+{
+	struct sdmmc_softc *sc = sf->sc;
+	struct sdmmc_command cmd;
+	int au, qty, timeout, last, error;
+
+	if (!sdmmc_mem_can_erase(sf))
+		return ENOTSUP;
+	if (nblks <= 0)
+		return EINVAL;
+
+	/* number of allocation units touched (assume 4 MiB if unknown) */
+	au = sf->ssr.au_size ? sf->ssr.au_size : 8192;
+	last = blkno + nblks - 1;
+	qty = last / au - blkno / au + 1;
+	if (sf->ssr.erase_timeout)
+		timeout = sf->ssr.erase_timeout * qty + sf->ssr.erase_offset;
+	else
+		timeout = 250 * qty;
+	if (timeout < 1000)
+		timeout = 1000;
+
+	rw_enter_write(&sc->sc_lock);
+
+	if ((error = sdmmc_select_card(sc, sf)) != 0)
+		goto out;
+
+	bzero(&cmd, sizeof cmd);
+	cmd.c_opcode = SD_ERASE_WR_BLK_START;
+	cmd.c_arg = (sf->flags & SFF_SDHC) ? blkno : blkno << 9;
+	cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1;
+	if ((error = sdmmc_mmc_command(sc, &cmd)) != 0)
+		goto out;
+
+	bzero(&cmd, sizeof cmd);
+	cmd.c_opcode = SD_ERASE_WR_BLK_END;
+	cmd.c_arg = (sf->flags & SFF_SDHC) ? last : last << 9;
+	cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1;
+	if ((error = sdmmc_mmc_command(sc, &cmd)) != 0)
+		goto out;
+
+	bzero(&cmd, sizeof cmd);
+	cmd.c_opcode = MMC_ERASE;
+	cmd.c_arg = sf->ssr.discard ? SD_DISCARD_ARG : SD_ERASE_ARG;
+	cmd.c_flags = SCF_CMD_AC | SCF_RSP_R1B;
+	cmd.c_timeout = timeout;
+	if ((error = sdmmc_mmc_command(sc, &cmd)) != 0)
+		goto out;
+
+	/* the R1b response waited for the end of the erase */
+	if (!sdmmc_mem_r1_ready(MMC_R1(cmd.c_resp)))
+		error = sdmmc_mem_wait_ready(sf);
+
+out:
+	rw_exit(&sc->sc_lock);
+	if (error)
+		UTL_ERR("%s: erase of %d blocks at %d failed (error %d)",
+		    DEVNAME(sc), nblks, blkno, error);
+	return error;
+}
+#endif /* __APPLE__ */
+
 #ifdef HIBERNATE
 int
 sdmmc_mem_hibernate_write(struct sdmmc_function *sf, daddr_t blkno,
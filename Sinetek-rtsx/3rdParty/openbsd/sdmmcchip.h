@@ -52,6 +52,10 @@ struct sdmmc_chip_functions {
 	int		(*signal_voltage)(sdmmc_chipset_handle_t, int);
 	/* hibernate */
 	int	(*hibernate_init)(sdmmc_chipset_handle_t, void *);
+#if __APPLE__
+	/* sampling point tuning (UHS-I SDR50/SDR104) */
+	int	(*execute_tuning)(sdmmc_chipset_handle_t, int);
+#endif
 };
 
 /* host controller reset */
@@ -83,12 +87,21 @@ struct sdmmc_chip_functions {
 /* UHS functions */
 #define sdmmc_chip_signal_voltage(tag, handle, voltage)			\
 	((tag)->signal_voltage((handle), (voltage)))
+#if __APPLE__
+#define sdmmc_chip_execute_tuning(tag, handle, timing)			\
+	((tag)->execute_tuning((handle), (timing)))
+#endif
 
 /* clock frequencies for sdmmc_chip_bus_clock() */
 #define SDMMC_SDCLK_OFF		0
 #define SDMMC_SDCLK_400KHZ	400
 #define SDMMC_SDCLK_25MHZ	25000
 #define SDMMC_SDCLK_50MHZ	50000
+#if __APPLE__
+#define SDMMC_SDCLK_20MHZ	20000
+#define SDMMC_SDCLK_100MHZ	100000
+#define SDMMC_SDCLK_208MHZ	208000
+#endif
 
 /* voltage levels for sdmmc_chip_signal_voltage() */
 #define SDMMC_SIGNAL_VOLTAGE_330	0
@@ -97,6 +110,11 @@ struct sdmmc_chip_functions {
 #define SDMMC_TIMING_LEGACY	0
 #define SDMMC_TIMING_HIGHSPEED	1
 #define SDMMC_TIMING_MMC_DDR52	2
+#if __APPLE__
+#define SDMMC_TIMING_UHS_SDR50	3
+#define SDMMC_TIMING_UHS_SDR104	4
+#define SDMMC_TIMING_UHS_DDR50	5
+#endif
 
 #define SDMMC_MAX_FUNCTIONS	8
 
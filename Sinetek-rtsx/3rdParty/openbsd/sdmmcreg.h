@@ -42,11 +42,26 @@
 #define SD_SEND_RELATIVE_ADDR		3	/* R6 */
 #define SD_SEND_SWITCH_FUNC		6	/* R1 */
 #define SD_SEND_IF_COND			8	/* R7 */
+#if __APPLE__
+#define SD_VOLTAGE_SWITCH		11	/* R1 */
+#define SD_SEND_TUNING_BLOCK		19	/* R1 */
+#endif
 
 /* SD application commands */			/* response type */
 #define SD_APP_SET_BUS_WIDTH		6	/* R1 */
 #define SD_APP_OP_COND			41	/* R3 */
 #define SD_APP_SEND_SCR			51	/* R1 */
+#if __APPLE__
+#define SD_APP_SD_STATUS		13	/* R1 */
+#define SD_APP_SET_WR_BLK_ERASE_COUNT	23	/* R1 */
+
+/* Erase commands */				/* response type */
+#define SD_ERASE_WR_BLK_START		32	/* R1 */
+#define SD_ERASE_WR_BLK_END		33	/* R1 */
+#define MMC_ERASE			38	/* R1B */
+#define  SD_ERASE_ARG			0x00000000
+#define  SD_DISCARD_ARG			0x00000001
+#endif
 
 /* OCR bits */
 #define MMC_OCR_MEM_READY		(1<<31)	/* memory power-up status bit */
@@ -72,11 +87,20 @@
 #define MMC_OCR_1_65V_1_95V		(1<<7)
 
 #define SD_OCR_SDHC_CAP			(1<<30)
+#if __APPLE__
+#define SD_OCR_S18R			(1<<24)	/* switch to 1.8V requested */
+#define SD_OCR_S18A			(1<<24)	/* switch to 1.8V accepted */
+#endif
 #define SD_OCR_VOL_MASK			0xFF8000 /* bits 23:15 */
 
 /* R1 response type bits */
 #define MMC_R1_READY_FOR_DATA		(1<<8)	/* ready for next transfer */
 #define MMC_R1_APP_CMD			(1<<5)	/* app. commands supported */
+#if __APPLE__
+#define MMC_R1_CURRENT_STATE(r1)	(((r1) >> 9) & 0xf)
+#define  MMC_R1_STATE_TRAN		4
+#define  MMC_R1_STATE_DATA		5
+#endif
 
 /* 48-bit response decoding (32 bits w/o CRC) */
 #define MMC_R1(resp)			((resp)[0])
@@ -147,6 +171,9 @@
 #define  MMC_CSD_MMCVER_2_0		2 /* MMC 2.0 - 2.2 */
 #define  MMC_CSD_MMCVER_3_1		3 /* MMC 3.1 - 3.3 */
 #define  MMC_CSD_MMCVER_4_0		4 /* MMC 4 */
+#if __APPLE__
+#define MMC_CSD_TRAN_SPEED(resp)	MMC_RSP_BITS((resp), 96, 8)
+#endif
 #define MMC_CSD_READ_BL_LEN(resp)	MMC_RSP_BITS((resp), 80, 4)
 #define MMC_CSD_C_SIZE(resp)		MMC_RSP_BITS((resp), 62, 12)
 #define MMC_CSD_CAPACITY(resp)		((MMC_CSD_C_SIZE((resp))+1) << \
@@ -276,10 +303,25 @@
 #define SCR_CMD_SUPPORT_CMD23(scr)	MMC_RSP_BITS((scr), 33, 1)
 #define SCR_CMD_SUPPORT_CMD20(scr)	MMC_RSP_BITS((scr), 32, 1)
 #define SCR_RESERVED2(scr)		MMC_RSP_BITS((scr), 0, 32)
+#if __APPLE__
+#define SCR_SD_SPECX(scr)		MMC_RSP_BITS((scr), 38, 4)
+
+/* SD Status (ACMD13, 512 bits) */
+#define SSR_AU_SIZE(ssr)		__bitfield((uint32_t *)(ssr), 428, 4)
+#define SSR_ERASE_SIZE(ssr)		__bitfield((uint32_t *)(ssr), 408, 16)
+#define SSR_ERASE_TIMEOUT(ssr)		__bitfield((uint32_t *)(ssr), 402, 6)
+#define SSR_ERASE_OFFSET(ssr)		__bitfield((uint32_t *)(ssr), 400, 2)
+#define SSR_DISCARD_SUPPORT(ssr)	__bitfield((uint32_t *)(ssr), 313, 1)
+#endif
 
 /* Status of Switch Function */
 #define SFUNC_STATUS_GROUP(status, group) \
 	(__bitfield((uint32_t *)(status), 400 + (group - 1) * 16, 16))
+#if __APPLE__
+/* Function actually selected by a mode 1 switch, 0xf on error. */
+#define SFUNC_STATUS_SELECTED(status, group) \
+	(__bitfield((uint32_t *)(status), 376 + (group - 1) * 4, 4))
+#endif
 
 #define SD_ACCESS_MODE_SDR12	0
 #define SD_ACCESS_MODE_SDR25	1
@@ -41,6 +41,9 @@ struct sdmmc_csd {
 	int	sector_size;	/* sector size in bytes */
 	int	read_bl_len;	/* block length for reads */
 	int	ccc;		/* Card Command Class for SD */
+#if __APPLE__
+	int	tran_speed;	/* max. default speed clock (kHz), 0 if unknown */
+#endif
 	/* ... */
 };
 
@@ -56,8 +59,35 @@ struct sdmmc_cid {
 struct sdmmc_scr {
 	int	sd_spec;
 	int	bus_width;
+#if __APPLE__
+	int	cmd23;		/* SET_BLOCK_COUNT supported */
+	int	sd_spec3;	/* SD spec. version 3.00 or later */
+	int	sd_specx;	/* SD spec. version 5.00 or later */
+#endif
+};
+
+#if __APPLE__
+/* decoded SD Status (ACMD13) */
+struct sdmmc_ssr {
+	int	au_size;	/* allocation unit in sectors (0: unknown) */
+	int	erase_timeout;	/* erase timeout per AU in ms (0: unknown) */
+	int	erase_offset;	/* erase timeout offset in ms */
+	int	discard;	/* CMD38 DISCARD argument supported */
 };
 
+/* per-card pre-erase (ACMD23) measurement, see sdmmc_mem_pre_erase_account() */
+struct sdmmc_pre_erase {
+	int		state;
+#define SDMMC_PRE_ERASE_OFF	0
+#define SDMMC_PRE_ERASE_PROBING	1
+#define SDMMC_PRE_ERASE_ON	2
+	int		samples[2];	/* measured writes: [0] plain, [1] pre-erased */
+	uint64_t	bytes[2];
+	uint64_t	nsecs[2];
+	uint64_t	rate[2];	/* resulting throughput in KiB/s */
+};
+#endif
+
 typedef u_int32_t sdmmc_response[4];
 
 struct sdmmc_softc;
@@ -68,6 +98,9 @@ struct sdmmc_task {
 	int onqueue;
 	struct sdmmc_softc *sc;
 	TAILQ_ENTRY(sdmmc_task) next;
+#if __APPLE__
+	struct sdmmc_task *submit_next;	/* submission stack link */
+#endif
 };
 
 #define	sdmmc_init_task(xtask, xfunc, xarg) do {			\
@@ -77,7 +110,16 @@ struct sdmmc_task {
 	(xtask)->sc = NULL;						\
 } while (0)
 
+#if __APPLE__
+/* sdmmc_task onqueue values */
+#define SDMMC_TASK_IDLE		0
+#define SDMMC_TASK_QUEUED	1	/* will run */
+#define SDMMC_TASK_CANCELLED	2	/* still queued, will be skipped */
+
+#define sdmmc_task_pending(xtask) ((xtask)->onqueue == SDMMC_TASK_QUEUED)
+#else
 #define sdmmc_task_pending(xtask) ((xtask)->onqueue)
+#endif
 
 struct sdmmc_command {
 	struct sdmmc_task c_task;	/* task queue entry */
@@ -113,6 +155,9 @@ struct sdmmc_command {
 #define SCF_RSP_R6	 (SCF_RSP_PRESENT|SCF_RSP_CRC|SCF_RSP_IDX)
 #define SCF_RSP_R7	 (SCF_RSP_PRESENT|SCF_RSP_CRC|SCF_RSP_IDX)
 	int		 c_error;	/* errno value on completion */
+#if __APPLE__
+	int		 c_timeout;	/* busy timeout in ms (0: default) */
+#endif
 
 	/* Host controller owned fields for data xfer in progress */
 	int c_resid;			/* remaining I/O */
@@ -150,6 +195,9 @@ struct sdmmc_function {
 	int flags;
 #define SFF_ERROR		0x0001	/* function is poo; ignore it */
 #define SFF_SDHC		0x0002	/* SD High Capacity card */
+#if __APPLE__
+#define SFF_CMD23		0x0004	/* use CMD23 for multiple block I/O */
+#endif
 	void *cookie;			/* pass extra info from bus to dev */
 	SIMPLEQ_ENTRY(sdmmc_function) sf_list;
 	/* SD card I/O function members */
@@ -162,6 +210,12 @@ struct sdmmc_function {
 	struct sdmmc_cid cid;		/* decoded CID value */
 	sdmmc_response raw_cid;		/* temp. storage for decoding */
 	struct sdmmc_scr scr;		/* decoded SCR value */
+#if __APPLE__
+	struct sdmmc_ssr ssr;		/* decoded SD Status */
+	struct sdmmc_pre_erase pre_erase; /* pre-erase measurement */
+	int timing;			/* SDMMC_TIMING_* the bus runs at */
+	int clock;			/* bus clock (kHz) */
+#endif
 };
 
 /*
@@ -175,7 +229,13 @@ struct sdmmc_softc {
 
 	bus_dma_tag_t sc_dmat;
 	bus_dmamap_t sc_dmap;
+#if __APPLE__
+/* Largest data transfer of a single command (MAXPHYS is only 128 KiB). */
+#define SDMMC_MAXXFER	(1024 * 1024)
+#define SDMMC_MAXNSEGS	((SDMMC_MAXXFER / PAGE_SIZE) + 1)
+#else
 #define SDMMC_MAXNSEGS	((MAXPHYS / PAGE_SIZE) + 1)
+#endif
 
 	int sc_flags;
 #define SMF_SD_MODE		0x0001	/* host in SD mode (MMC otherwise) */
@@ -185,6 +245,9 @@ struct sdmmc_softc {
 #define SMF_CARD_ATTACHED	0x0020	/* card driver(s) attached */
 #define	SMF_STOP_AFTER_MULTIPLE	0x0040	/* send a stop after a multiple cmd */
 #define SMF_CONFIG_PENDING	0x0080	/* config_pending_incr() called */
+#if __APPLE__
+#define SMF_UHS_MODE		0x0100	/* card signals at 1.8V (UHS-I) */
+#endif
 
 	uint32_t sc_caps;		/* host capability */
 #define SMC_CAPS_AUTO_STOP	0x0001	/* send CMD12 automagically by host */
@@ -205,6 +268,9 @@ struct sdmmc_softc {
 #define SMC_CAPS_MMC_HS200	0x4000	/* eMMC HS200 timing */
 #define SMC_CAPS_MMC_HS400	0x8000	/* eMMC HS400 timing */
 #define SMC_CAPS_NONREMOVABLE	0x10000	/* non-removable devices */
+#if __APPLE__
+#define SMC_CAPS_WAIT_BUSY_END	0x20000	/* writes complete once DAT0 is released */
+#endif
 
 	int sc_function_count;		/* number of I/O functions (SDIO) */
 	struct sdmmc_function *sc_card;	/* selected card */
@@ -212,14 +278,36 @@ struct sdmmc_softc {
 	SIMPLEQ_HEAD(, sdmmc_function) sf_head; /* list of card functions */
 	int sc_dying;			/* bus driver is shutting down */
 	struct proc *sc_task_thread;	/* asynchronous tasks */
+#if __APPLE__
+	TAILQ_HEAD(sdmmc_task_list, sdmmc_task) sc_tskq; /* task thread work queue */
+#else
 	TAILQ_HEAD(, sdmmc_task) sc_tskq;   /* task thread work queue */
+#endif
 	struct sdmmc_task sc_discover_task; /* card attach/detach task */
 	struct sdmmc_task sc_intr_task;	/* card interrupt task */
+#if __APPLE__
+	struct sdmmc_task * volatile sc_tsk_submit; /* submitted tasks (LIFO) */
+	struct mutex sc_tskq_mtx;	/* task thread sleep/wakeup */
+#endif
 	struct rwlock sc_lock;		/* lock around host controller */
 	void *sc_scsibus;		/* SCSI bus emulation softc */
 	TAILQ_HEAD(, sdmmc_intr_handler) sc_intrq; /* interrupt handlers */
 	long sc_max_seg;		/* maximum segment size */
 	long sc_max_xfer;		/* maximum transfer size */
+#if __APPLE__
+	/* block I/O statistics (published by SDDisk) */
+	uint64_t sc_stat_xfers;		/* read/write block transfers */
+	uint64_t sc_stat_xfer_cmds;	/* commands sent for those transfers */
+	uint64_t sc_stat_cmd23;		/* transfers bounded by CMD23 */
+	uint64_t sc_stat_cmd12;		/* transfers ended by CMD12 */
+	uint64_t sc_stat_cmd23_errors;	/* CMD23 failures (fell back to CMD12) */
+	uint64_t sc_stat_status_polls;	/* SEND_STATUS sent after transfers */
+	uint64_t sc_stat_status_skipped; /* transfers which needed no poll */
+	uint64_t sc_stat_pre_erase;	/* writes preceded by ACMD23 */
+	uint64_t sc_stat_uhs_fallbacks;	/* UHS-I modes given up for High Speed */
+	uint64_t sc_stat_tasks;		/* tasks run by the task thread */
+	uint64_t sc_stat_task_wakeups;	/* times the task thread slept */
+#endif
 	void *sc_cookies[SDMMC_MAX_FUNCTIONS]; /* pass extra info from bus to dev */
 };
 
@@ -242,6 +330,12 @@ struct sdmmc_attach_args {
 
 void	sdmmc_add_task(struct sdmmc_softc *, struct sdmmc_task *);
 void	sdmmc_del_task(struct sdmmc_task *);
+#if __APPLE__
+struct	sdmmc_task *sdmmc_task_take(struct sdmmc_softc *);
+void	sdmmc_task_drain(struct sdmmc_softc *);
+int	sdmmc_task_idle(struct sdmmc_task *);
+void	sdmmc_task_wakeup(struct sdmmc_softc *);
+#endif
 
 struct	sdmmc_function *sdmmc_function_alloc(struct sdmmc_softc *);
 void	sdmmc_function_free(struct sdmmc_function *);
@@ -290,6 +384,14 @@ void	sdmmc_mem_scan(struct sdmmc_softc *);
 int	sdmmc_mem_init(struct sdmmc_softc *, struct sdmmc_function *);
 int	sdmmc_mem_read_block(struct sdmmc_function *, int, u_char *, size_t);
 int	sdmmc_mem_write_block(struct sdmmc_function *, int, u_char *, size_t);
+#if __APPLE__
+int	sdmmc_mem_read_block_raw(struct sdmmc_function *, int,
+	    bus_dma_segment_t *, int, size_t);
+int	sdmmc_mem_write_block_raw(struct sdmmc_function *, int,
+	    bus_dma_segment_t *, int, size_t);
+int	sdmmc_mem_can_erase(struct sdmmc_function *);
+int	sdmmc_mem_erase(struct sdmmc_function *, int, int);
+#endif
 
 #ifdef HIBERNATE
 int	sdmmc_mem_hibernate_write(struct sdmmc_function *, daddr_t, u_char *,
@@ -4,7 +4,10 @@
 #include <IOKit/storage/IOBlockStorageDevice.h>
 #include <IOKit/storage/IOBlockStorageDriver.h> // kIOMediaStateOffline
 #include <IOKit/storage/IOMedia.h> // kIOMediaIconKey
+#include <IOKit/storage/IOStorageDeviceCharacteristics.h> // kIOMaximumBlockCountReadKey
 #include <IOKit/IOMemoryDescriptor.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <kern/thread.h> // current_thread
 
 #define UTL_THIS_CLASS "SDDisk::"
 
@@ -78,8 +81,43 @@ static void setIcon(IOService *sddiskIOService)
 	UTL_SAFE_RELEASE_NULL(dictionary);
 }
 
+static inline bool bitTest(const uint64_t *map, UInt64 bit)
+{
+	return (map[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void bitSet(uint64_t *map, UInt64 bit)
+{
+	map[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static inline void bitClear(uint64_t *map, UInt64 bit)
+{
+	map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+/// Completion of the requests which are waited for (see SDDisk::doUnmap())
+struct SDDiskSyncRequest
+{
+	IOLock *	lock;
+	IOReturn	status;
+	bool		done;
+};
+
+static void syncRequestDone(void *target, void *parameter, IOReturn status, UInt64 actualByteCount)
+{
+	auto sync = (SDDiskSyncRequest *) parameter;
+	IOLockLock(sync->lock);
+	sync->status = status;
+	sync->done = true;
+	IOLockWakeup(sync->lock, sync, true);
+	IOLockUnlock(sync->lock);
+}
+
 } // namespace
 
+void read_task_impl_(void *_that);
+
 bool SDDisk::init(struct sdmmc_softc *sc_sdmmc, OSDictionary* properties)
 {
 	UTL_DEBUG_FUN("START");
@@ -88,6 +126,35 @@ bool SDDisk::init(struct sdmmc_softc *sc_sdmmc, OSDictionary* properties)
 
 	card_is_write_protected_ = true;
 	sdmmc_softc_ = sc_sdmmc;
+	max_xfer_bytes_ = MAXPHYS;
+	dma_command_ = nullptr;
+	copy_thread_call_ = nullptr;
+	bzero(&copy_job_, sizeof(copy_job_));
+	dma_pool_count_ = 0;
+	bzero(dma_pool_, sizeof(dma_pool_));
+	TAILQ_INIT(&bio_queue_);
+	sdmmc_init_task(&bio_task_, read_task_impl_, this);
+	bio_slab_waiters_ = 0;
+	bio_task_thread_ = nullptr;
+	detaching_ = false;
+	bio_task_running_ = false;
+	bzero(ra_bufs_, sizeof(ra_bufs_));
+	ra_count_ = 0;
+	ra_window_ = kReadAheadMinWindow;
+	ra_next_block_ = 0;
+	ra_seq_reads_ = 0;
+	ra_prefetch_pending_ = false;
+	bzero(wb_segs_, sizeof(wb_segs_));
+	wb_count_ = 0;
+	wb_seg_blocks_ = 0;
+	wb_enabled_ = false;
+	wb_thread_call_ = nullptr;
+	wb_timer_armed_ = false;
+	bzero(&stats_, sizeof(stats_));
+	util_lock_ = IOLockAlloc();
+	UTL_CHK_PTR(util_lock_, false);
+	wb_lock_ = IOLockAlloc();
+	UTL_CHK_PTR(wb_lock_, false);
 #if RTSX_DEBUG_RETAIN_RELEASE
 	debugRetainReleaseEnabled = false;
 	debugRetainReleaseCount = 0;
@@ -103,6 +170,15 @@ void SDDisk::free()
 {
 	UTL_DEBUG_FUN("START");
 	sdmmc_softc_ = NULL;
+	bio_slab_.free();
+	if (util_lock_) {
+		IOLockFree(util_lock_);
+		util_lock_ = nullptr;
+	}
+	if (wb_lock_) {
+		IOLockFree(wb_lock_);
+		wb_lock_ = nullptr;
+	}
 	super::free();
 	UTL_LOG("SDDisk freed.");
 }
@@ -129,10 +205,74 @@ bool SDDisk::attach(IOService* provider)
 
 	printf("rtsx: attaching SDDisk, num_blocks:%d  blk_size:%d\n",
 	       num_blocks_, blk_size_);
+	publishTransferLimits();
+	publishPhysicalBlockSize();
+	publishBusMode();
 
 	// check whether the card is write-protected
 	card_is_write_protected_ = provider_->cardIsWriteProtected();
 
+	// IODMACommand used to obtain the scatter/gather list of the client buffers. We ask for 64-bit addresses so that
+	// IODMACommand never bounces by itself; transferBlocks() checks the segments and bounces only when needed.
+	IODMACommand::SegmentOptions segmentOptions = { .fStructSize = sizeof(segmentOptions),
+							.fNumAddressBits = 64,
+							.fMaxSegmentSize = (uint64_t) sdmmc_softc_->sc_max_seg,
+							.fMaxTransferSize = 0,
+							.fAlignment = 1,
+							.fAlignmentLength = 1,
+							.fAlignmentInternalSegments = 1 };
+	dma_command_ = IODMACommand::withSpecification(kIODMACommandOutputHost64, &segmentOptions,
+						       kIODMAMapOptionMapped, nullptr, nullptr);
+	if (!dma_command_) {
+		UTL_ERR("Could not create IODMACommand, all transfers will use a bounce buffer!");
+	}
+
+	// Pre-allocate the bounce buffers, so that allocation cost does not show up in the I/O latency
+	extern int Sinetek_rtsx_boot_arg_dma_pool;
+	extern int Sinetek_rtsx_boot_arg_no_adma;
+	if (!Sinetek_rtsx_boot_arg_no_adma)
+		dmaPoolCreate(Sinetek_rtsx_boot_arg_dma_pool, max_xfer_bytes_);
+
+	// Request objects come from a slab, so that the I/O path does not call the kernel allocator
+	if (!bio_slab_.init(kBioSlabCapacity)) {
+		UTL_ERR("Could not allocate the request slab!");
+		return false;
+	}
+
+	extern int Sinetek_rtsx_boot_arg_ra_max_kb;
+	if (Sinetek_rtsx_boot_arg_ra_max_kb > 0)
+		readAheadCreate((IOByteCount) Sinetek_rtsx_boot_arg_ra_max_kb * 1024);
+
+	extern int Sinetek_rtsx_boot_arg_write_cache;
+	extern int Sinetek_rtsx_boot_arg_write_cache_kb;
+	if (Sinetek_rtsx_boot_arg_write_cache_kb > 0) {
+		wb_thread_call_ = thread_call_allocate(writeCacheThreadCall, this);
+		if (wb_thread_call_)
+			writeCacheCreate((IOByteCount) Sinetek_rtsx_boot_arg_write_cache_kb * 1024);
+		else
+			UTL_ERR("Could not allocate thread call, write-back cache disabled!");
+		wb_enabled_ = wb_count_ > 0 && Sinetek_rtsx_boot_arg_write_cache;
+	}
+
+	extern int Sinetek_rtsx_boot_arg_no_pipeline;
+	if (!Sinetek_rtsx_boot_arg_no_pipeline) {
+		copy_thread_call_ = thread_call_allocate_with_priority(copyThreadCall, this,
+								       THREAD_CALL_PRIORITY_HIGH);
+		if (!copy_thread_call_) {
+			UTL_ERR("Could not allocate thread call, pipelined mode disabled!");
+		}
+	}
+
+	// unmapped blocks are erased (discarded if the card supports it)
+	if (sdmmc_mem_can_erase(sdmmc_softc_->sc_fn0)) {
+		auto features = OSDictionary::withCapacity(1);
+		if (features) {
+			features->setObject(kIOStorageFeatureUnmap, kOSBooleanTrue);
+			setProperty(kIOStorageFeaturesKey, features);
+			features->release();
+		}
+	}
+
 	UTL_LOG("SDDisk attached%s", card_is_write_protected_ ? " (card is write-protected)" : "");
 	return true;
 }
@@ -140,6 +280,40 @@ bool SDDisk::attach(IOService* provider)
 void SDDisk::detach(IOService* provider)
 {
 	UTL_LOG("SDDisk detaching (retainCount=%d)...", this->getRetainCount());
+	// fail the requests that have not been processed yet, and wait for the one being processed: the buffers freed
+	// below are used by bio_task_
+	IOLockLock(util_lock_);
+	detaching_ = true;
+	BioArgs *pending = TAILQ_FIRST(&bio_queue_);
+	TAILQ_INIT(&bio_queue_);
+	ra_prefetch_pending_ = false;
+	while (bio_task_running_ && current_thread() != bio_task_thread_)
+		IOLockSleep(util_lock_, &bio_task_running_, THREAD_UNINT);
+	IOLockUnlock(util_lock_);
+	// bio_task_ is freed with this object, sdmmc_del_task() only returns once the task queue is done with it (it may
+	// wait for the task thread, which is why util_lock_ is not held: bio_task_ takes it)
+	sdmmc_del_task(&bio_task_);
+	while (pending) {
+		BioArgs *next = TAILQ_NEXT(pending, link);
+		completeRequest(pending, ENODEV);
+		pending = next;
+	}
+	// the card is gone (or has been flushed by doEjectMedia()), whatever is still cached is lost
+	if (wb_thread_call_) {
+		thread_call_cancel_wait(wb_thread_call_);
+		thread_call_free(wb_thread_call_);
+		wb_thread_call_ = nullptr;
+	}
+	writeCacheDestroy();
+
+	UTL_SAFE_RELEASE_NULL(dma_command_);
+	if (copy_thread_call_) {
+		thread_call_cancel_wait(copy_thread_call_);
+		thread_call_free(copy_thread_call_);
+		copy_thread_call_ = nullptr;
+	}
+	dmaPoolDestroy();
+	readAheadDestroy();
 	UTL_SAFE_RELEASE_NULL(provider_);
 
 	super::detach(provider);
@@ -150,6 +324,105 @@ void SDDisk::detach(IOService* provider)
 #endif
 }
 
+bool SDDisk::serializeProperties(OSSerialize *s) const
+{
+	// Statistics are only published when somebody reads the registry, so that the I/O path does not pay for it.
+	const_cast<SDDisk *>(this)->updateStatisticsProperty();
+	return super::serializeProperties(s);
+}
+
+void SDDisk::updateStatisticsProperty()
+{
+	// card command counters are kept by the sdmmc layer ("commands per transfer" = commands / transfers)
+	const struct sdmmc_softc *sc = sdmmc_softc_;
+	const struct sdmmc_function *sf = sc ? sc->sc_fn0 : nullptr;
+	// completion waits are counted by the host controller
+	const struct rtsx_softc *hc = provider_ ? provider_->rtsx_softc_original_ : nullptr;
+	// lock usage, times are in microseconds
+	const struct lock_stats *intr_lock = hc ? &hc->intr_mtx.mtx_stats : nullptr;
+	const struct lock_stats *tskq_lock = sc ? &sc->sc_tskq_mtx.mtx_stats : nullptr;
+	struct lock_stats ctl_lock;
+	Sinetek_rtsx_openbsd_compat_spl_stats(&ctl_lock);
+	const struct {
+		const char *key;
+		uint64_t value;
+	} counters[] = {
+		{ "Zero-copy requests", stats_.zero_copy_requests },
+		{ "Bounced requests", stats_.bounced_requests },
+		{ "DMA pool hits", stats_.dma_pool_hits },
+		{ "DMA pool misses", stats_.dma_pool_misses },
+		{ "Pipelined requests", stats_.pipelined_requests },
+		{ "Requests", stats_.requests },
+		{ "Transfers", stats_.transfers },
+		{ "Merged requests", stats_.merged_requests },
+		{ "Request slab waits", stats_.slab_waits },
+		{ "Request slab fallbacks", stats_.slab_fallbacks },
+		{ "Read-ahead hits", stats_.ra_hits },
+		{ "Read-ahead misses", stats_.ra_misses },
+		{ "Read-ahead bytes", stats_.ra_prefetched_bytes },
+		{ "Read-ahead wasted bytes", stats_.ra_wasted_bytes },
+		{ "Read-ahead window", ra_window_ },
+		{ "Write cache absorbed requests", stats_.wb_absorbed_requests },
+		{ "Write cache bypassed requests", stats_.wb_bypassed_requests },
+		{ "Write cache flushes", stats_.wb_flushes },
+		{ "Write cache flushed bytes", stats_.wb_flushed_bytes },
+		{ "Write cache filled bytes", stats_.wb_filled_bytes },
+		{ "Write cache errors", stats_.wb_errors },
+		{ "Unmap requests", stats_.unmap_requests },
+		{ "Unmapped ranges", stats_.unmap_ranges },
+		{ "Erase commands", stats_.erase_commands },
+		{ "Erased bytes", stats_.erased_bytes },
+		{ "AU splits", stats_.au_splits },
+		{ "Card transfers", sc ? sc->sc_stat_xfers : 0 },
+		{ "Card transfer commands", sc ? sc->sc_stat_xfer_cmds : 0 },
+		{ "CMD23 transfers", sc ? sc->sc_stat_cmd23 : 0 },
+		{ "CMD12 transfers", sc ? sc->sc_stat_cmd12 : 0 },
+		{ "CMD23 errors", sc ? sc->sc_stat_cmd23_errors : 0 },
+		{ "Status polls", sc ? sc->sc_stat_status_polls : 0 },
+		{ "Status polls skipped", sc ? sc->sc_stat_status_skipped : 0 },
+		{ "Pre-erase commands", sc ? sc->sc_stat_pre_erase : 0 },
+		{ "Pre-erase state", sf ? (uint64_t) sf->pre_erase.state : 0 },	// 0: off, 1: measuring, 2: on
+		{ "Pre-erase write rate (KiB/s)", sf ? sf->pre_erase.rate[1] : 0 },
+		{ "Plain write rate (KiB/s)", sf ? sf->pre_erase.rate[0] : 0 },
+		{ "UHS-I fallbacks", sc ? sc->sc_stat_uhs_fallbacks : 0 },
+		{ "Tasks run", sc ? sc->sc_stat_tasks : 0 },
+		{ "Task thread wakeups", sc ? sc->sc_stat_task_wakeups : 0 },
+		{ "Spin waits", hc ? hc->stat_spin_waits : 0 },
+		{ "Sleep waits", hc ? hc->stat_sleep_waits : 0 },
+		{ "Completions in interrupt filter", hc ? hc->stat_intr_filtered : 0 },
+		{ "Card events on workloop", hc ? hc->stat_intr_deferred : 0 },
+		{ "Waits < 10 us", hc ? hc->stat_wait_hist[0] : 0 },
+		{ "Waits < 50 us", hc ? hc->stat_wait_hist[1] : 0 },
+		{ "Waits < 100 us", hc ? hc->stat_wait_hist[2] : 0 },
+		{ "Waits < 500 us", hc ? hc->stat_wait_hist[3] : 0 },
+		{ "Waits < 1 ms", hc ? hc->stat_wait_hist[4] : 0 },
+		{ "Waits < 10 ms", hc ? hc->stat_wait_hist[5] : 0 },
+		{ "Waits >= 10 ms", hc ? hc->stat_wait_hist[6] : 0 },
+		{ "Controller lock acquires", ctl_lock.ls_acquires },
+		{ "Controller lock contended", ctl_lock.ls_contended },
+		{ "Controller lock wait us", ctl_lock.ls_wait_ns / 1000 },
+		{ "Controller lock hold us", ctl_lock.ls_hold_ns / 1000 },
+		{ "Controller lock max hold us", ctl_lock.ls_hold_max_ns / 1000 },
+		{ "Interrupt lock contended", intr_lock ? intr_lock->ls_contended : 0 },
+		{ "Interrupt lock wait us", intr_lock ? intr_lock->ls_wait_ns / 1000 : 0 },
+		{ "Interrupt lock max hold us", intr_lock ? intr_lock->ls_hold_max_ns / 1000 : 0 },
+		{ "Task queue lock contended", tskq_lock ? tskq_lock->ls_contended : 0 },
+		{ "Task queue lock wait us", tskq_lock ? tskq_lock->ls_wait_ns / 1000 : 0 },
+		{ "Task queue lock max hold us", tskq_lock ? tskq_lock->ls_hold_max_ns / 1000 : 0 },
+	};
+	auto dict = OSDictionary::withCapacity(sizeof(counters) / sizeof(counters[0]));
+	UTL_CHK_PTR(dict,);
+	for (auto &counter : counters) {
+		auto num = OSNumber::withNumber(counter.value, 64);
+		if (num) {
+			dict->setObject(counter.key, num);
+			num->release();
+		}
+	}
+	setProperty("RTSX Statistics", dict);
+	dict->release();
+}
+
 IOReturn SDDisk::SendMessageMediaOffline() {
 	// Notify clients that the disk has been detached, this should make all the lower nodes disappear in
 	// IORegistryExplorer
@@ -159,6 +432,10 @@ IOReturn SDDisk::SendMessageMediaOffline() {
 IOReturn SDDisk::doEjectMedia(void)
 {
 	UTL_DEBUG_FUN("START");
+	// ejecting would drop the blocks that could not be written
+	IOReturn ret = flushWriteCache();
+	if (ret != kIOReturnSuccess)
+		return ret;
 	provider_->cardEject();
 	UTL_DEBUG_FUN("END");
 	return kIOReturnSuccess;
@@ -204,7 +481,7 @@ IOReturn SDDisk::doLockUnlockMedia(bool doLock)
 IOReturn SDDisk::doSynchronizeCache(void)
 {
 	UTL_DEBUG_FUN("START");
-	return kIOReturnSuccess;
+	return flushWriteCache();
 }
 
 char* SDDisk::getVendorString(void)
@@ -304,128 +581,1179 @@ IOReturn SDDisk::reportWriteProtection(bool *isWriteProtected)
 IOReturn SDDisk::getWriteCacheState(bool *enabled)
 {
 	UTL_DEBUG_FUN("START");
-	return kIOReturnUnsupported;
+	if (wb_count_ == 0)
+		return kIOReturnUnsupported;
+	*enabled = wb_enabled_;
+	return kIOReturnSuccess;
 }
 
 IOReturn SDDisk::setWriteCacheState(bool enabled)
 {
-	UTL_DEBUG_FUN("START");
-	return kIOReturnUnsupported;
+	UTL_DEBUG_FUN("START (enabled = %d)", enabled);
+	if (wb_count_ == 0)
+		return kIOReturnUnsupported;
+	IOLockLock(wb_lock_);
+	int error = enabled ? 0 : writeCacheFlushAll();
+	if (!error)
+		wb_enabled_ = enabled;
+	IOLockUnlock(wb_lock_);
+	if (!error)
+		UTL_LOG("Write-back cache %s", enabled ? "enabled" : "disabled");
+	return error ? kIOReturnIOError : kIOReturnSuccess;
 }
 
-struct BioArgs
+/// Writes all the cached blocks to the card.
+IOReturn SDDisk::flushWriteCache()
 {
-	IOMemoryDescriptor *buffer;
-	IODirection direction;
-	UInt64 block;
-	UInt64 nblks;
-	IOStorageAttributes attributes;
-	IOStorageCompletion completion;
-	SDDisk *that;
-};
+	if (wb_count_ == 0)
+		return kIOReturnSuccess;
+	IOLockLock(wb_lock_);
+	int error = writeCacheFlushAll();
+	IOLockUnlock(wb_lock_);
+	return error ? kIOReturnIOError : kIOReturnSuccess;
+}
 
-// cholonam: This task is put on a queue which is run by sc::task_execute_one_ (originally using a timer, now trying to
-// change to an IOCommandGate.
-void read_task_impl_(void *_args)
+/// Computes the per-command transfer ceiling and publishes it, so that IOBlockStorageDriver builds requests that we
+/// can send to the card as they are.
+void SDDisk::publishTransferLimits()
 {
-	BioArgs *args = (BioArgs *) _args;
-	IOByteCount actualByteCount;
-	int error = 0;
+	extern int Sinetek_rtsx_boot_arg_max_xfer_kb;
+	// sc_max_xfer is set by rtsx_attach() from the chip's DMA limits (16-bit block count, 24-bit ADMA length)
+	IOByteCount maxXfer = sdmmc_softc_->sc_max_xfer ? sdmmc_softc_->sc_max_xfer : MAXPHYS;
+	if (Sinetek_rtsx_boot_arg_max_xfer_kb > 0 && (IOByteCount) Sinetek_rtsx_boot_arg_max_xfer_kb * 1024 < maxXfer)
+		maxXfer = (IOByteCount) Sinetek_rtsx_boot_arg_max_xfer_kb * 1024;
+	maxXfer -= maxXfer % blk_size_;
+	if (maxXfer < blk_size_)
+		maxXfer = blk_size_;
+	max_xfer_bytes_ = maxXfer;
+
+	uint64_t maxBlocks = maxXfer / blk_size_;
+	uint64_t maxSegments = SDMMC_MAXNSEGS;
+	uint64_t maxSegmentBytes = sdmmc_softc_->sc_max_seg;
+	const struct {
+		const char *key;
+		uint64_t value;
+	} limits[] = {
+		{ kIOMaximumBlockCountReadKey, maxBlocks },
+		{ kIOMaximumBlockCountWriteKey, maxBlocks },
+		{ kIOMaximumByteCountReadKey, maxXfer },
+		{ kIOMaximumByteCountWriteKey, maxXfer },
+		{ kIOMaximumSegmentCountReadKey, maxSegments },
+		{ kIOMaximumSegmentCountWriteKey, maxSegments },
+		{ kIOMaximumSegmentByteCountReadKey, maxSegmentBytes },
+		{ kIOMaximumSegmentByteCountWriteKey, maxSegmentBytes },
+	};
+	for (auto &limit : limits) {
+		auto num = OSNumber::withNumber(limit.value, 64);
+		if (num) {
+			setProperty(limit.key, num);
+			num->release();
+		}
+	}
+	UTL_LOG("Maximum transfer per command: %llu KiB (%llu blocks)", (uint64_t) maxXfer / 1024, maxBlocks);
+}
 
-	UTL_CHK_PTR(args,);
-	UTL_CHK_PTR(args->buffer,);
-	UTL_CHK_PTR(args->that,);
-	UTL_CHK_PTR(args->that->provider_,);
-	UTL_CHK_PTR(args->that->provider_->rtsx_softc_original_,);
-	UTL_CHK_PTR(args->that->provider_->rtsx_softc_original_->sdmmc,);
-	auto sdmmc = (struct sdmmc_softc *) args->that->provider_->rtsx_softc_original_->sdmmc;
-	UTL_CHK_PTR(sdmmc->sc_fn0,);
-	UTL_DEBUG_FUN("START (%s block = %u nblks = %u blksize = %u physSectSize = %u)",
-		      args->direction == kIODirectionIn ? "READ" : "WRITE",
-		      static_cast<unsigned>(args->block),
-		      static_cast<unsigned>(args->nblks),
-		      args->that->blk_size_,
-		      sdmmc->sc_fn0->csd.sector_size);
-
-	actualByteCount = args->nblks * args->that->blk_size_;
-	static const IOByteCount maxSendBytes = 128 * 1024;
-	// we can use a static buffer because this method is not reentrant
-	static u_char static_buffer[maxSendBytes];
-	IOByteCount remainingBytes = args->nblks * 512;
-	IOByteCount sentBytes = 0;
-	int blocks = (int) args->block;
-	bus_dma_segment_t dma_segs[SDMMC_MAXNSEGS];
-	int               rsegs = 0;
-	u_char *          buf;
+/// Publishes the allocation unit of the card (from the SD Status) as physical block size. Writes are split on AU
+/// boundaries (see chunkBytes()), so that the card does not have to rewrite parts of two AUs for a single command.
+void SDDisk::publishPhysicalBlockSize()
+{
+	auto sf = sdmmc_softc_->sc_fn0;
+	au_blocks_ = (UInt64) sf->ssr.au_size * 512 / blk_size_;
+	if (au_blocks_ == 0)
+		return;
+
+	auto characteristics = OSDictionary::withCapacity(1);
+	auto num = OSNumber::withNumber(au_blocks_ * blk_size_, 64);
+	if (characteristics && num) {
+		characteristics->setObject(kIOPropertyPhysicalBlockSizeKey, num);
+		setProperty(kIOPropertyDeviceCharacteristicsKey, characteristics);
+	}
+	OSSafeReleaseNULL(num);
+	OSSafeReleaseNULL(characteristics);
+	UTL_LOG("Allocation unit: %llu KiB", (uint64_t) au_blocks_ * blk_size_ / 1024);
+}
 
-	extern int Sinetek_rtsx_boot_arg_no_adma;
-	if (!Sinetek_rtsx_boot_arg_no_adma) {
-		// Since the 'args->buffer' IOMemoryDescriptor that we receive may have it's physical pages in the >4GB
-		// memory, we need to copy it to a new buffer allocated using OpenBSD dma functions. This way we can
-		// obtain a scatter/gather list from it with addresses below 4GB.
-		buf = (u_char *)dma_alloc(actualByteCount > maxSendBytes ? maxSendBytes : actualByteCount, dma_segs,
-					  SDMMC_MAXNSEGS, &rsegs,
-					  args->direction == kIODirectionIn ? BUS_DMA_READ : BUS_DMA_WRITE);
+/// Publishes the bus mode negotiated with the card (e.g. "UHS-I SDR104") and its clock in the "RTSX Bus Mode" and
+/// "RTSX Bus Clock (kHz)" properties.
+void SDDisk::publishBusMode()
+{
+	auto sc = sdmmc_softc_;
+	auto sf = sc->sc_fn0;
+	bool sd = ISSET(sc->sc_flags, SMF_SD_MODE);
+	const char *mode;
+
+	switch (sf->timing) {
+	case SDMMC_TIMING_UHS_SDR104:	mode = "UHS-I SDR104"; break;
+	case SDMMC_TIMING_UHS_SDR50:	mode = "UHS-I SDR50"; break;
+	case SDMMC_TIMING_UHS_DDR50:	mode = "UHS-I DDR50"; break;
+	case SDMMC_TIMING_MMC_DDR52:	mode = "MMC DDR52"; break;
+	case SDMMC_TIMING_HIGHSPEED:
+		// SDR25 is High Speed at 1.8V signalling
+		mode = !sd ? "MMC High Speed" : ISSET(sc->sc_flags, SMF_UHS_MODE) ? "UHS-I SDR25" : "High Speed";
+		break;
+	default:
+		mode = sd ? "Default Speed" : "MMC Legacy";
+		break;
+	}
+
+	setProperty("RTSX Bus Mode", mode);
+	setProperty("RTSX Bus Clock (kHz)", (unsigned long long) sf->clock, 32);
+	UTL_LOG("Bus mode: %s, %d kHz", mode, sf->clock);
+}
+
+/// Size of the next command of a transfer at 'block' with 'remaining' bytes left: at most max_xfer_bytes_, and writes
+/// end at the next allocation unit boundary.
+IOByteCount SDDisk::chunkBytes(IODirection direction, UInt64 block, IOByteCount remaining)
+{
+	IOByteCount len = MIN(remaining, max_xfer_bytes_);
+	if (direction == kIODirectionOut && au_blocks_ > 0) {
+		UInt64 boundary = (block / au_blocks_ + 1) * au_blocks_;
+		if (block + len / blk_size_ > boundary) {
+			len = (boundary - block) * blk_size_;
+			stats_.au_splits++;
+		}
+	}
+	return len;
+}
+
+void SDDisk::dmaPoolCreate(int count, bus_size_t size)
+{
+	if (count > kMaxDMAPoolBuffers) {
+		UTL_LOG("DMA pool limited to %d buffers (%d requested)", kMaxDMAPoolBuffers, count);
+		count = kMaxDMAPoolBuffers;
+	}
+	dma_pool_count_ = 0;
+	for (int i = 0; i < count; i++) {
+		auto &dmaBuf = dma_pool_[i];
+		dmaBuf.kva = (u_char *) dma_alloc(size, dmaBuf.segs, SDMMC_MAXNSEGS, &dmaBuf.rsegs,
+						  BUS_DMA_READ | BUS_DMA_WRITE);
+		if (!dmaBuf.kva) {
+			UTL_ERR("Could only allocate %d out of %d DMA pool buffers", i, count);
+			break;
+		}
+		dmaBuf.size = size;
+		dmaBuf.pooled = true;
+		dmaBuf.in_use = false;
+		dma_pool_count_++;
+	}
+	UTL_LOG("DMA pool: %d buffers of %lu KiB", dma_pool_count_, size / 1024);
+}
+
+void SDDisk::dmaPoolDestroy()
+{
+	for (int i = 0; i < dma_pool_count_; i++) {
+		auto &dmaBuf = dma_pool_[i];
+		if (dmaBuf.in_use) {
+			UTL_ERR("DMA pool buffer %d is still in use!", i);
+		}
+		dma_free(dmaBuf.kva, dmaBuf.size, dmaBuf.segs, dmaBuf.rsegs);
+		dmaBuf.kva = nullptr;
+	}
+	dma_pool_count_ = 0;
+}
+
+/// Returns a DMA buffer of at least 'size' bytes, from the pool if possible. Must be returned with dmaBufferPut().
+SDDiskDMABuffer *SDDisk::dmaBufferGet(bus_size_t size, int flags)
+{
+	IOLockLock(util_lock_);
+	for (int i = 0; i < dma_pool_count_; i++) {
+		auto &dmaBuf = dma_pool_[i];
+		if (!dmaBuf.in_use && dmaBuf.size >= size) {
+			dmaBuf.in_use = true;
+			stats_.dma_pool_hits++;
+			IOLockUnlock(util_lock_);
+			return &dmaBuf;
+		}
+	}
+	stats_.dma_pool_misses++;
+	IOLockUnlock(util_lock_);
+
+	// pool exhausted (or disabled), allocate a buffer just for this request
+	auto dmaBuf = UTL_MALLOC(SDDiskDMABuffer);
+	UTL_CHK_PTR(dmaBuf, nullptr);
+	dmaBuf->kva = (u_char *) dma_alloc(size, dmaBuf->segs, SDMMC_MAXNSEGS, &dmaBuf->rsegs, flags);
+	if (!dmaBuf->kva) {
+		UTL_FREE(dmaBuf, SDDiskDMABuffer);
+		return nullptr;
+	}
+	dmaBuf->size = size;
+	dmaBuf->pooled = false;
+	dmaBuf->in_use = true;
+	return dmaBuf;
+}
+
+void SDDisk::dmaBufferPut(SDDiskDMABuffer *dmaBuf)
+{
+	UTL_CHK_PTR(dmaBuf,);
+	if (dmaBuf->pooled) {
+		IOLockLock(util_lock_);
+		dmaBuf->in_use = false;
+		IOLockUnlock(util_lock_);
 	} else {
-		buf = static_buffer;
+		dma_free(dmaBuf->kva, dmaBuf->size, dmaBuf->segs, dmaBuf->rsegs);
+		UTL_FREE(dmaBuf, SDDiskDMABuffer);
 	}
+}
 
-	if (!buf) {
-		error = ENOMEM;
-		goto complete;
+/// Generates the scatter/gather list for the range [offset, offset + length) of the client buffer into dma_segs_.
+///
+/// Returns the number of segments, or 0 if the range cannot be handed to the ADMA engine as it is (pages above 4 GB,
+/// misaligned segments or more segments than the descriptor table can hold), in which case the caller has to bounce.
+int SDDisk::loadClientSegments(IOByteCount offset, IOByteCount length)
+{
+	static const uint64_t alignMask = 512 - 1; // same requirement as Linux's block layer (dma_alignment = 511)
+	IOByteCount end = offset + length;
+	int nsegs = 0;
+
+	while (offset < end) {
+		IODMACommand::Segment64 segment;
+		UInt32                  numSeg = 1;
+		if (dma_command_->genIOVMSegments(&offset, &segment, &numSeg) != kIOReturnSuccess ||
+		    numSeg != 1)
+			return 0;
+		if (offset > end) {
+			segment.fLength -= (offset - end);
+			offset = end;
+		}
+		if (nsegs == SDMMC_MAXNSEGS)
+			return 0; // the ADMA descriptor table cannot hold this many segments
+		if (segment.fIOVMAddr + segment.fLength > 0x100000000ULL)
+			return 0; // the ADMA engine only supports 32-bit addresses
+		if ((segment.fIOVMAddr | segment.fLength) & alignMask)
+			return 0;
+		dma_segs_[nsegs].ds_addr = segment.fIOVMAddr;
+		dma_segs_[nsegs].ds_len = segment.fLength;
+		nsegs++;
 	}
-	while (remainingBytes > 0) {
-		IOByteCount sendByteCount = remainingBytes > maxSendBytes ? maxSendBytes : remainingBytes;
+	return nsegs;
+}
+
+void SDDisk::copyStart(IOMemoryDescriptor *buffer, IOByteCount offset, u_char *kva, IOByteCount length, bool toClient)
+{
+	IOLockLock(util_lock_);
+	copy_job_.buffer = buffer;
+	copy_job_.offset = offset;
+	copy_job_.length = length;
+	copy_job_.kva = kva;
+	copy_job_.to_client = toClient;
+	copy_job_.copied = 0;
+	copy_job_.busy = true;
+	IOLockUnlock(util_lock_);
+	thread_call_enter(copy_thread_call_);
+}
+
+/// Waits for the copy started with copyStart(). Returns true if all the bytes were copied.
+bool SDDisk::copyWait()
+{
+	IOLockLock(util_lock_);
+	while (copy_job_.busy)
+		IOLockSleep(util_lock_, &copy_job_, THREAD_UNINT);
+	bool ok = copy_job_.copied == copy_job_.length;
+	IOLockUnlock(util_lock_);
+	return ok;
+}
+
+void SDDisk::copyThreadCall(thread_call_param_t param0, thread_call_param_t param1)
+{
+	auto that = (SDDisk *) param0;
+	auto &job = that->copy_job_;
+	IOByteCount copied = job.to_client ? job.buffer->writeBytes(job.offset, job.kva, job.length)
+					   : job.buffer->readBytes(job.offset, job.kva, job.length);
+	IOLockLock(that->util_lock_);
+	job.copied = copied;
+	job.busy = false;
+	IOLockWakeup(that->util_lock_, &job, true);
+	IOLockUnlock(that->util_lock_);
+}
 
-		if (args->direction == kIODirectionIn) {
-			error = UTL_RUN_WITH_RETRY(3, sdmmc_mem_read_block, sdmmc->sc_fn0, blocks, buf, sendByteCount);
+/// Transfers nblks blocks between the card and 'buffer', in commands of at most max_xfer_bytes_ (writes are also split
+/// on allocation unit boundaries, see chunkBytes()).
+///
+/// Chunks are transferred zero-copy whenever possible. Once a chunk needs to be bounced, the rest of the request is
+/// bounced too, using two DMA buffers if available: the copy of chunk N (done by copy_thread_call_) then overlaps with
+/// the card transfer of chunk N+1 (reads) or N-1 (writes).
+int SDDisk::transferBlocks(IOMemoryDescriptor *buffer, IODirection direction, UInt64 block, UInt64 nblks)
+{
+	extern int Sinetek_rtsx_boot_arg_no_adma;
+	// we can use a static buffer because this method is not reentrant
+	static u_char static_buffer[MAXPHYS];
+
+	auto sf = sdmmc_softc_->sc_fn0;
+	bool read = direction == kIODirectionIn;
+	int dmaFlags = read ? BUS_DMA_READ : BUS_DMA_WRITE;
+	IOByteCount totalBytes = nblks * blk_size_;
+	IOByteCount offset = 0;
+	int blkno = (int) block;
+	SDDiskDMABuffer *dmaBufs[2] = { nullptr, nullptr };
+	u_char *bufs[2] = { nullptr, nullptr };
+	int cur = 0;
+	bool bounced = false;
+	bool pipelined = false;
+	bool copyPending = false; // copy_job_ is running
+	bool staged = false;      // (writes) the current chunk has already been copied to bufs[cur]
+	IOByteCount stagedLen = 0; // (writes) length of the chunk being copied ahead
+	int error = 0;
+
+	// Zero-copy: let the ADMA engine transfer straight from/to the client buffer whenever its segments allow it.
+	bool zeroCopy = !Sinetek_rtsx_boot_arg_no_adma && dma_command_ &&
+			ISSET(sdmmc_softc_->sc_caps, SMC_CAPS_DMA) && !ISSET(sdmmc_softc_->sc_caps, SMC_CAPS_SINGLE_ONLY);
+	if (zeroCopy && UTL_CHK_SUCCESS(dma_command_->setMemoryDescriptor(buffer)) != kIOReturnSuccess)
+		zeroCopy = false;
+
+	while (offset < totalBytes) {
+		IOByteCount len = staged ? stagedLen : chunkBytes(direction, blkno, totalBytes - offset);
+		int nsegs = (zeroCopy && !bounced) ? loadClientSegments(offset, len) : 0;
+
+		if (nsegs > 0) {
+			if (read) {
+				error = UTL_RUN_WITH_RETRY(3, sdmmc_mem_read_block_raw, sf, blkno, dma_segs_, nsegs,
+							   len);
+			} else {
+				error = UTL_RUN_WITH_RETRY(3, sdmmc_mem_write_block_raw, sf, blkno, dma_segs_, nsegs,
+							   len);
+			}
 			if (error)
 				break;
-			IOByteCount copied_bytes = args->buffer->writeBytes(sentBytes, buf, sendByteCount);
-			if (copied_bytes == 0) {
-				error = EIO;
-				break;
-			}
 		} else {
-			IOByteCount copied_bytes = args->buffer->readBytes(sentBytes, buf, sendByteCount);
-			if (copied_bytes == 0) {
-				error = EIO;
-				break;
+			if (!bounced) {
+				bounced = true;
+				if (!Sinetek_rtsx_boot_arg_no_adma) {
+					// Since the 'buffer' IOMemoryDescriptor that we receive may have it's physical pages
+					// in the >4GB memory, we need to copy it to a buffer allocated using OpenBSD dma
+					// functions. This way we can obtain a scatter/gather list from it with addresses
+					// below 4GB.
+					// sized for the largest chunk still to come, not for this one: a write chunk
+					// may have been cut short at an allocation unit boundary
+					IOByteCount bufSize = MIN(totalBytes - offset, max_xfer_bytes_);
+					dmaBufs[0] = dmaBufferGet(bufSize, dmaFlags);
+					if (dmaBufs[0] && copy_thread_call_ && totalBytes - offset > len)
+						dmaBufs[1] = dmaBufferGet(bufSize, dmaFlags);
+					bufs[0] = dmaBufs[0] ? dmaBufs[0]->kva : nullptr;
+					bufs[1] = dmaBufs[1] ? dmaBufs[1]->kva : nullptr;
+				} else {
+					bufs[0] = static_buffer;
+				}
+				if (!bufs[0]) {
+					error = ENOMEM;
+					break;
+				}
+				pipelined = bufs[1] != nullptr;
 			}
-			error = UTL_RUN_WITH_RETRY(3, sdmmc_mem_write_block, sdmmc->sc_fn0, blocks, buf, sendByteCount);
-			if (error)
-				break;
+			u_char *buf = bufs[cur];
+			if (read) {
+				error = UTL_RUN_WITH_RETRY(3, sdmmc_mem_read_block, sf, blkno, buf, len);
+				// the previous chunk has been copied to the client while the card was busy
+				if (copyPending) {
+					copyPending = false;
+					if (!copyWait() && !error)
+						error = EIO;
+				}
+				if (error)
+					break;
+				if (pipelined) {
+					copyStart(buffer, offset, buf, len, true);
+					copyPending = true;
+				} else if (buffer->writeBytes(offset, buf, len) != len) {
+					error = EIO;
+					break;
+				}
+			} else {
+				if (!staged && buffer->readBytes(offset, buf, len) != len) {
+					error = EIO;
+					break;
+				}
+				staged = false;
+				// copy the next chunk while the card is busy with this one
+				IOByteCount nextOffset = offset + len;
+				if (pipelined && nextOffset < totalBytes) {
+					stagedLen = chunkBytes(direction, blkno + len / blk_size_, totalBytes - nextOffset);
+					copyStart(buffer, nextOffset, bufs[cur ^ 1], stagedLen, false);
+					copyPending = true;
+				}
+				error = UTL_RUN_WITH_RETRY(3, sdmmc_mem_write_block, sf, blkno, buf, len);
+				if (copyPending) {
+					copyPending = false;
+					if (copyWait())
+						staged = true;
+					else if (!error)
+						error = EIO;
+				}
+				if (error)
+					break;
+			}
+			if (pipelined)
+				cur ^= 1;
 		}
-		blocks += (sendByteCount / 512);
-		remainingBytes -= sendByteCount;
-		sentBytes += sendByteCount;
+		blkno += len / blk_size_;
+		offset += len;
+	}
+	if (copyPending && !copyWait() && !error)
+		error = EIO;
+	if (zeroCopy)
+		dma_command_->clearMemoryDescriptor();
+	for (auto dmaBuf : dmaBufs) {
+		if (dmaBuf)
+			dmaBufferPut(dmaBuf);
+	}
+	if (bounced)
+		stats_.bounced_requests++;
+	else if (error == 0)
+		stats_.zero_copy_requests++;
+	if (pipelined)
+		stats_.pipelined_requests++;
+	return error;
+}
+
+/// Returns a request object, waiting for one if the slab is exhausted (back-pressure). The task thread (a completion
+/// may submit the next request from there) cannot wait, since it is the one returning requests to the slab, and gets
+/// one from the heap right away, as does anybody who waited a second in vain.
+BioArgs *SDDisk::requestAlloc()
+{
+	BioArgs *args = bio_slab_.get();
+	if (args)
+		return args;
+
+	if (current_thread() == bio_task_thread_) {
+		IOLockLock(util_lock_);
+		stats_.slab_fallbacks++;
+		IOLockUnlock(util_lock_);
+		return UTL_MALLOC(BioArgs);
 	}
-	if (!Sinetek_rtsx_boot_arg_no_adma) {
-		dma_free(buf, actualByteCount, dma_segs, rsegs);
+
+	IOLockLock(util_lock_);
+	stats_.slab_waits++;
+	bio_slab_waiters_++;
+	AbsoluteTime deadline = nsecs2AbsoluteTimeDeadline(1000000000ULL);
+	while (!(args = bio_slab_.get())) {
+		if (IOLockSleepDeadline(util_lock_, &bio_slab_, deadline, THREAD_UNINT) == THREAD_TIMED_OUT) {
+			args = bio_slab_.get();
+			break;
+		}
+	}
+	bio_slab_waiters_--;
+	if (!args)
+		stats_.slab_fallbacks++;
+	IOLockUnlock(util_lock_);
+
+	if (!args)
+		args = UTL_MALLOC(BioArgs);
+	return args;
+}
+
+void SDDisk::requestFree(BioArgs *args)
+{
+	if (!bio_slab_.contains(args)) {
+		UTL_FREE(args, BioArgs);
+		return;
+	}
+	bio_slab_.put(args);
+	if (bio_slab_waiters_) {
+		IOLockLock(util_lock_);
+		IOLockWakeup(util_lock_, &bio_slab_, true);
+		IOLockUnlock(util_lock_);
+	}
+}
+
+void SDDisk::completeRequest(BioArgs *args, int error)
+{
+	IOByteCount actualByteCount = args->nblks * blk_size_;
+	IOStorageCompletion completion = args->completion;
+
+	if (error != 0) {
+		UTL_ERR("Returning an Error!"
+			" (%s block = %u nblks = %u blksize = %u error = %d)",
+			args->direction == kIODirectionIn ? "READ" :
+			args->direction == kIODirectionOut ? "WRITE" : "UNMAP",
+			static_cast<unsigned>(args->block),
+			static_cast<unsigned>(args->nblks),
+			blk_size_, error);
 	}
-complete:
-	if (args->completion.action) {
+	// free the request before calling the completion, which may submit a new request (IOBlockStorageDriver does
+	// this when it breaks up large requests)
+	requestFree(args);
+
+	if (completion.action) {
 		if (error == 0) {
-			(args->completion.action)(args->completion.target, args->completion.parameter,
-						  kIOReturnSuccess, actualByteCount);
+			(completion.action)(completion.target, completion.parameter, kIOReturnSuccess, actualByteCount);
 		} else {
-			UTL_ERR("Returning an Error!"
-				" (%s block = %u nblks = %u blksize = %u physSectSize = %u error = %d)",
-				args->direction == kIODirectionIn ? "READ" : "WRITE",
-				static_cast<unsigned>(args->block),
-				static_cast<unsigned>(args->nblks),
-				args->that->blk_size_,
-				sdmmc->sc_fn0->csd.sector_size, error);
-			(args->completion.action)(args->completion.target, args->completion.parameter,
-						  error == ENOMEM ? kIOReturnNoMemory : kIOReturnIOError, 0);
+			(completion.action)(completion.target, completion.parameter,
+					    error == ENOMEM ? kIOReturnNoMemory :
+					    error == ENODEV ? kIOReturnNotAttached :
+					    error == ENOTSUP ? kIOReturnUnsupported :
+					    error == EINVAL ? kIOReturnBadArgument : kIOReturnIOError, 0);
 		}
 	} else {
 		UTL_ERR("No completion action!");
 	}
-	delete args;
+}
+
+/// Transfers a group of contiguous requests (same direction) as a single transfer and completes each of them.
+void SDDisk::processRequests(BioArgs **requests, int count)
+{
+	BioArgs *first = requests[0];
+	UInt64 nblks = 0;
+	int error;
+
+	if (isInactive() || !sdmmc_softc_->sc_fn0) {
+		for (int i = 0; i < count; i++)
+			completeRequest(requests[i], ENODEV);
+		return;
+	}
+
+	if (first->direction == kIODirectionNone) {
+		// unmap requests are never merged
+		completeRequest(first, unmapExtents(first->extents, first->extents_count));
+		return;
+	}
+
+	if (first->direction == kIODirectionIn) {
+		if (ra_count_ > 0) {
+			// serve the leading requests from memory, the rest goes to the card
+			while (count > 0 && readAheadServe(requests[0])) {
+				readAheadTrack(requests[0]->block, requests[0]->nblks);
+				stats_.ra_hits++;
+				completeRequest(requests[0], 0);
+				requests++;
+				count--;
+			}
+			if (count == 0)
+				return;
+			first = requests[0];
+			stats_.ra_misses += count;
+		}
+		if (wb_count_ > 0) {
+			// blocks waiting in the write-back cache must reach the card before they are read
+			UInt64 groupBlocks = 0;
+			for (int i = 0; i < count; i++)
+				groupBlocks += requests[i]->nblks;
+			IOLockLock(wb_lock_);
+			error = writeCacheFlushRange(first->block, groupBlocks);
+			IOLockUnlock(wb_lock_);
+			if (error) {
+				// the card does not have the latest contents of the blocks
+				for (int i = 0; i < count; i++)
+					completeRequest(requests[i], error);
+				return;
+			}
+		}
+	} else {
+		// the read-ahead buffers must not keep the old contents of the blocks being written
+		for (int i = 0; ra_count_ > 0 && i < count; i++)
+			readAheadInvalidate(requests[i]->block, requests[i]->nblks);
+
+		if (wb_count_ > 0) {
+			UInt64 groupBlocks = 0;
+			bool absorb = true;
+			for (int i = 0; i < count; i++) {
+				groupBlocks += requests[i]->nblks;
+				if (requests[i]->attributes.options & kIOStorageOptionForceUnitAccess)
+					absorb = false;
+			}
+			IOLockLock(wb_lock_);
+			absorb = absorb && wb_enabled_ && groupBlocks < wb_seg_blocks_;
+			if (absorb) {
+				// small writes: copy them to the cache and complete them right away
+				int errors[kMaxMergedRequests];
+				for (int i = 0; i < count; i++) {
+					errors[i] = writeCacheAbsorb(requests[i]);
+					if (errors[i] != ENOSPC)
+						stats_.wb_absorbed_requests++;
+				}
+				IOLockUnlock(wb_lock_);
+				for (int i = 0; i < count; i++) {
+					// no segment could be freed, write it directly
+					if (errors[i] == ENOSPC) {
+						errors[i] = transferBlocks(requests[i]->buffer, requests[i]->direction,
+									   requests[i]->block, requests[i]->nblks);
+						stats_.transfers++;
+					}
+					completeRequest(requests[i], errors[i]);
+				}
+				return;
+			}
+			// large writes go to the card, older cached copies of the blocks must not be written over them later
+			// (if they cannot be flushed, they are superseded anyway)
+			if (writeCacheFlushRange(first->block, groupBlocks) != 0)
+				writeCacheForget(first->block, groupBlocks);
+			if (wb_enabled_)
+				stats_.wb_bypassed_requests += count;
+			IOLockUnlock(wb_lock_);
+		}
+	}
+
+	IOMultiMemoryDescriptor *multi = nullptr;
+	if (count > 1) {
+		IOMemoryDescriptor *buffers[kMaxMergedRequests];
+		for (int i = 0; i < count; i++) {
+			buffers[i] = requests[i]->buffer;
+			nblks += requests[i]->nblks;
+		}
+		multi = IOMultiMemoryDescriptor::withDescriptors(buffers, count, first->direction, false);
+		if (!multi) {
+			// could not merge, transfer them one by one
+			for (int i = 0; i < count; i++) {
+				error = transferBlocks(requests[i]->buffer, requests[i]->direction, requests[i]->block,
+						       requests[i]->nblks);
+				stats_.transfers++;
+				completeRequest(requests[i], error);
+			}
+			return;
+		}
+		stats_.merged_requests += count - 1;
+	} else {
+		nblks = first->nblks;
+	}
+
+	UTL_DEBUG_FUN("START (%s block = %u nblks = %u requests = %d)",
+		      first->direction == kIODirectionIn ? "READ" : "WRITE",
+		      static_cast<unsigned>(first->block), static_cast<unsigned>(nblks), count);
+	error = transferBlocks(multi ? multi : first->buffer, first->direction, first->block, nblks);
+	stats_.transfers++;
+	OSSafeReleaseNULL(multi);
+	if (error == 0 && first->direction == kIODirectionIn)
+		readAheadTrack(first->block, nblks);
+	for (int i = 0; i < count; i++)
+		completeRequest(requests[i], error);
 	UTL_DEBUG_FUN("END (error = %d)", error);
 }
 
+/// Makes sure that bio_task_ runs if there are requests waiting (unless we are detaching). Must be called with
+/// util_lock_ held.
+void SDDisk::scheduleRequests()
+{
+	if (detaching_)
+		return;
+	if ((!TAILQ_EMPTY(&bio_queue_) || ra_prefetch_pending_) && !sdmmc_task_pending(&bio_task_))
+		sdmmc_add_task(sdmmc_softc_, &bio_task_);
+}
+
+void SDDisk::readAheadCreate(IOByteCount maxBytes)
+{
+	IOByteCount size = MIN(max_xfer_bytes_, maxBytes);
+	size -= size % blk_size_;
+	if (size == 0)
+		return;
+	int count = (int) MIN(maxBytes / size, (IOByteCount) kMaxReadAheadBuffers);
+	ra_count_ = 0;
+	for (int i = 0; i < count; i++) {
+		auto &raBuf = ra_bufs_[i];
+		raBuf.dma.kva = (u_char *) dma_alloc(size, raBuf.dma.segs, SDMMC_MAXNSEGS, &raBuf.dma.rsegs,
+						     BUS_DMA_READ);
+		if (!raBuf.dma.kva) {
+			UTL_ERR("Could only allocate %d out of %d read-ahead buffers", i, count);
+			break;
+		}
+		raBuf.dma.size = size;
+		raBuf.dma.pooled = true;
+		raBuf.valid = false;
+		ra_count_++;
+	}
+	ra_window_ = MIN((IOByteCount) kReadAheadMinWindow, size);
+	UTL_LOG("Read-ahead: %d buffers of %llu KiB", ra_count_, (uint64_t) size / 1024);
+}
+
+void SDDisk::readAheadDestroy()
+{
+	for (int i = 0; i < ra_count_; i++) {
+		auto &raBuf = ra_bufs_[i];
+		dma_free(raBuf.dma.kva, raBuf.dma.size, raBuf.dma.segs, raBuf.dma.rsegs);
+		raBuf.dma.kva = nullptr;
+		raBuf.valid = false;
+	}
+	ra_count_ = 0;
+}
+
+SDDiskReadAheadBuffer *SDDisk::readAheadFind(UInt64 block)
+{
+	for (int i = 0; i < ra_count_; i++) {
+		auto &raBuf = ra_bufs_[i];
+		if (raBuf.valid && block >= raBuf.block && block < raBuf.block + raBuf.nblks)
+			return &raBuf;
+	}
+	return nullptr;
+}
+
+/// Empties a read-ahead buffer. The window shrinks if part of the buffer was never requested, and grows otherwise.
+void SDDisk::readAheadDrop(SDDiskReadAheadBuffer &raBuf)
+{
+	if (!raBuf.valid)
+		return;
+	raBuf.valid = false;
+	UInt64 end = raBuf.block + raBuf.nblks;
+	UInt64 unused = end - MIN(MAX(raBuf.used_end, raBuf.block), end);
+	if (unused > 0) {
+		stats_.ra_wasted_bytes += unused * blk_size_;
+		ra_window_ = MAX(ra_window_ / 2, MIN((IOByteCount) kReadAheadMinWindow, (IOByteCount) ra_bufs_[0].dma.size));
+	} else {
+		ra_window_ = MIN(ra_window_ * 2, (IOByteCount) (ra_count_ * ra_bufs_[0].dma.size));
+	}
+}
+
+void SDDisk::readAheadInvalidate(UInt64 block, UInt64 nblks)
+{
+	for (int i = 0; i < ra_count_; i++) {
+		auto &raBuf = ra_bufs_[i];
+		if (raBuf.valid && block < raBuf.block + raBuf.nblks && raBuf.block < block + nblks)
+			readAheadDrop(raBuf);
+	}
+}
+
+/// Copies the blocks of a read request from the read-ahead buffers. Returns false (and copies nothing) unless all
+/// of them are cached.
+bool SDDisk::readAheadServe(BioArgs *args)
+{
+	UInt64 end = args->block + args->nblks;
+	for (UInt64 block = args->block; block < end;) {
+		auto raBuf = readAheadFind(block);
+		if (!raBuf)
+			return false;
+		block = raBuf->block + raBuf->nblks;
+	}
+
+	IOByteCount offset = 0;
+	for (UInt64 block = args->block; block < end;) {
+		auto raBuf = readAheadFind(block);
+		UInt64 n = MIN(end, raBuf->block + raBuf->nblks) - block;
+		IOByteCount len = n * blk_size_;
+		if (args->buffer->writeBytes(offset, raBuf->dma.kva + (block - raBuf->block) * blk_size_, len) != len)
+			return false; // the card will be asked instead
+		raBuf->used_end = MAX(raBuf->used_end, block + n);
+		block += n;
+		offset += len;
+	}
+	return true;
+}
+
+/// Follows the reads done by the client. Once a read continues the previous one, a prefetch is scheduled.
+void SDDisk::readAheadTrack(UInt64 block, UInt64 nblks)
+{
+	if (ra_count_ == 0)
+		return;
+	ra_seq_reads_ = block == ra_next_block_ ? ra_seq_reads_ + 1 : 0;
+	ra_next_block_ = block + nblks;
+	if (ra_seq_reads_ > 0) {
+		IOLockLock(util_lock_);
+		// bio_task_ must not be queued again once detach() has cancelled it
+		if (!detaching_) {
+			ra_prefetch_pending_ = true;
+			scheduleRequests();
+		}
+		IOLockUnlock(util_lock_);
+	}
+}
+
+/// Reads the next chunk of the sequential stream into a free read-ahead buffer. Called by bio_task_ when no request
+/// is waiting, so a prefetch delays a new request by one chunk at most. Asks to be called again until ra_window_
+/// bytes are cached after the stream position.
+void SDDisk::readAheadStep()
+{
+	if (ra_count_ == 0 || ra_seq_reads_ == 0 || isInactive() || !sdmmc_softc_->sc_fn0)
+		return;
+
+	// end of the blocks already cached (contiguously) after the stream position
+	UInt64 aheadEnd = ra_next_block_;
+	for (SDDiskReadAheadBuffer *raBuf; (raBuf = readAheadFind(aheadEnd)) != nullptr;)
+		aheadEnd = raBuf->block + raBuf->nblks;
+	if ((aheadEnd - ra_next_block_) * blk_size_ >= ra_window_ || aheadEnd >= num_blocks_)
+		return;
+
+	// take an empty buffer, or else the lowest one that is not ahead of the stream
+	SDDiskReadAheadBuffer *victim = nullptr;
+	for (int i = 0; i < ra_count_; i++) {
+		auto &raBuf = ra_bufs_[i];
+		if (!raBuf.valid) {
+			victim = &raBuf;
+			break;
+		}
+		bool ahead = raBuf.block < aheadEnd && raBuf.block + raBuf.nblks > ra_next_block_;
+		if (!ahead && (!victim || raBuf.block < victim->block))
+			victim = &raBuf;
+	}
+	if (!victim)
+		return;
+	readAheadDrop(*victim);
+
+	IOByteCount len = MIN((IOByteCount) victim->dma.size, ra_window_);
+	len = MIN(len, (IOByteCount) ((num_blocks_ - aheadEnd) * blk_size_));
+	len -= len % blk_size_;
+	if (wb_count_ > 0) {
+		IOLockLock(wb_lock_);
+		int error = writeCacheFlushRange(aheadEnd, len / blk_size_);
+		IOLockUnlock(wb_lock_);
+		if (error)
+			return;
+	}
+	int error = UTL_RUN_WITH_RETRY(3, sdmmc_mem_read_block, sdmmc_softc_->sc_fn0, (int) aheadEnd,
+				       victim->dma.kva, len);
+	if (error) {
+		UTL_ERR("Read-ahead of %llu bytes at block %llu failed (error = %d)", (uint64_t) len, aheadEnd, error);
+		return;
+	}
+	victim->block = aheadEnd;
+	victim->nblks = len / blk_size_;
+	victim->used_end = aheadEnd;
+	victim->valid = true;
+	stats_.ra_prefetched_bytes += len;
+
+	IOLockLock(util_lock_);
+	if (!detaching_) {
+		ra_prefetch_pending_ = true;
+		scheduleRequests();
+	}
+	IOLockUnlock(util_lock_);
+}
+
+void SDDisk::writeCacheCreate(IOByteCount maxBytes)
+{
+	IOByteCount size = MIN((IOByteCount) kWriteCacheSegmentSize, max_xfer_bytes_);
+	size -= size % blk_size_;
+	if (size == 0 || size / blk_size_ > sizeof(wb_segs_[0].dirty) * 8)
+		return;
+	int count = (int) MIN(maxBytes / size, (IOByteCount) kMaxWriteCacheSegments);
+	wb_count_ = 0;
+	for (int i = 0; i < count; i++) {
+		auto &seg = wb_segs_[i];
+		seg.dma.kva = (u_char *) dma_alloc(size, seg.dma.segs, SDMMC_MAXNSEGS, &seg.dma.rsegs,
+						   BUS_DMA_READ | BUS_DMA_WRITE);
+		if (!seg.dma.kva) {
+			UTL_ERR("Could only allocate %d out of %d write cache segments", i, count);
+			break;
+		}
+		seg.dma.size = size;
+		seg.dma.pooled = true;
+		seg.valid = false;
+		wb_count_++;
+	}
+	wb_seg_blocks_ = size / blk_size_;
+	UTL_LOG("Write-back cache: %d segments of %llu KiB", wb_count_, (uint64_t) size / 1024);
+}
+
+void SDDisk::writeCacheDestroy()
+{
+	for (int i = 0; i < wb_count_; i++) {
+		auto &seg = wb_segs_[i];
+		if (seg.valid) {
+			UTL_ERR("Write cache segment at block %llu was never written to the card!", seg.block);
+			stats_.wb_errors++;
+		}
+		dma_free(seg.dma.kva, seg.dma.size, seg.dma.segs, seg.dma.rsegs);
+		seg.dma.kva = nullptr;
+		seg.valid = false;
+	}
+	wb_count_ = 0;
+}
+
+SDDiskWriteCacheSegment *SDDisk::writeCacheFind(UInt64 block)
+{
+	for (int i = 0; i < wb_count_; i++) {
+		auto &seg = wb_segs_[i];
+		if (seg.valid && block >= seg.block && block < seg.block + wb_seg_blocks_)
+			return &seg;
+	}
+	return nullptr;
+}
+
+/// Writes the dirty blocks of a segment to the card and frees the segment. The holes between the dirty blocks are
+/// read from the card first, so that the segment goes out as a single multi-block write (scattered small writes are
+/// what cheap cards are slowest at). The writes have already been reported as complete, so on error the segment keeps
+/// the blocks that could not be written, for the next flush to retry (and report), unless the card is gone. Must be
+/// called with wb_lock_ held.
+int SDDisk::writeCacheFlushSegment(SDDiskWriteCacheSegment &seg)
+{
+	if (!seg.valid)
+		return 0;
+	auto sf = sdmmc_softc_ ? sdmmc_softc_->sc_fn0 : nullptr;
+	UInt64 first = wb_seg_blocks_, last = 0;
+	int error = 0;
+
+	for (UInt64 i = 0; i < wb_seg_blocks_; i++) {
+		if (bitTest(seg.dirty, i)) {
+			if (first == wb_seg_blocks_)
+				first = i;
+			last = i;
+		}
+	}
+	if (first == wb_seg_blocks_)
+		goto done; // nothing to write
+	if (!sf) {
+		error = ENODEV;
+		goto done;
+	}
+
+	for (UInt64 i = first; i <= last;) {
+		if (bitTest(seg.dirty, i)) {
+			i++;
+			continue;
+		}
+		UInt64 end = i;
+		while (!bitTest(seg.dirty, end))
+			end++;
+		IOByteCount len = (end - i) * blk_size_;
+		if (UTL_RUN_WITH_RETRY(3, sdmmc_mem_read_block, sf, (int) (seg.block + i), seg.dma.kva + i * blk_size_,
+				       len) != 0)
+			break;
+		stats_.wb_filled_bytes += len;
+		for (; i < end; i++)
+			bitSet(seg.dirty, i);
+	}
+
+	// write each run of dirty blocks (a single one unless a hole could not be filled)
+	for (UInt64 i = first; i <= last && !error;) {
+		if (!bitTest(seg.dirty, i)) {
+			i++;
+			continue;
+		}
+		UInt64 end = i;
+		while (end <= last && bitTest(seg.dirty, end))
+			end++;
+		IOByteCount len = (end - i) * blk_size_;
+		error = UTL_RUN_WITH_RETRY(3, sdmmc_mem_write_block, sf, (int) (seg.block + i),
+					   seg.dma.kva + i * blk_size_, len);
+		if (!error) {
+			stats_.wb_flushed_bytes += len;
+			for (; i < end; i++)
+				bitClear(seg.dirty, i);
+		}
+		i = end;
+	}
+	stats_.wb_flushes++;
+
+done:
+	if (error) {
+		UTL_ERR("Could not write cached blocks at block %llu (error = %d)", seg.block, error);
+		stats_.wb_errors++;
+		if (error != ENODEV)
+			return error;
+	}
+	seg.valid = false;
+	bzero(seg.dirty, sizeof(seg.dirty));
+	return error;
+}
+
+/// Flushes the segments holding any of the blocks [block, block + nblks). Must be called with wb_lock_ held.
+int SDDisk::writeCacheFlushRange(UInt64 block, UInt64 nblks)
+{
+	int error = 0;
+	for (int i = 0; i < wb_count_; i++) {
+		auto &seg = wb_segs_[i];
+		if (seg.valid && block < seg.block + wb_seg_blocks_ && seg.block < block + nblks) {
+			int segError = writeCacheFlushSegment(seg);
+			if (!error)
+				error = segError;
+		}
+	}
+	return error;
+}
+
+/// Drops the cached copies of the blocks [block, block + nblks), which are about to be written over (or erased) on
+/// the card. Must be called with wb_lock_ held.
+void SDDisk::writeCacheForget(UInt64 block, UInt64 nblks)
+{
+	for (int i = 0; i < wb_count_; i++) {
+		auto &seg = wb_segs_[i];
+		if (!seg.valid || block >= seg.block + wb_seg_blocks_ || seg.block >= block + nblks)
+			continue;
+		UInt64 first = MAX(block, seg.block) - seg.block;
+		UInt64 end = MIN(block + nblks, seg.block + wb_seg_blocks_) - seg.block;
+		bool dirty = false;
+		for (UInt64 j = 0; j < wb_seg_blocks_; j++) {
+			if (j >= first && j < end)
+				bitClear(seg.dirty, j);
+			else if (bitTest(seg.dirty, j))
+				dirty = true;
+		}
+		if (!dirty)
+			seg.valid = false;
+	}
+}
+
+int SDDisk::writeCacheFlushAll()
+{
+	int error = 0;
+	for (int i = 0; i < wb_count_; i++) {
+		int segError = writeCacheFlushSegment(wb_segs_[i]);
+		if (!error)
+			error = segError;
+	}
+	return error;
+}
+
+/// Copies the blocks of a write request to the cache. When no segment is free, the one that has been dirty for the
+/// longest time is flushed. If that fails, ENOSPC is returned with none of the request left in the cache: the error
+/// belongs to the flushed blocks, the request has to go to the card by itself. Must be called with wb_lock_ held.
+int SDDisk::writeCacheAbsorb(BioArgs *args)
+{
+	UInt64 end = args->block + args->nblks;
+	IOByteCount offset = 0;
+
+	for (UInt64 block = args->block; block < end;) {
+		UInt64 segBlock = block - block % wb_seg_blocks_;
+		UInt64 n = MIN(end, segBlock + wb_seg_blocks_) - block;
+		auto seg = writeCacheFind(segBlock);
+		if (!seg) {
+			for (int i = 0; i < wb_count_; i++) {
+				auto &candidate = wb_segs_[i];
+				if (!candidate.valid) {
+					seg = &candidate;
+					break;
+				}
+				if (!seg || candidate.dirty_since < seg->dirty_since)
+					seg = &candidate;
+			}
+			if (writeCacheFlushSegment(*seg) != 0) {
+				writeCacheForget(args->block, args->nblks);
+				return ENOSPC;
+			}
+			seg->block = segBlock;
+			seg->dirty_since = mach_absolute_time();
+			seg->valid = true;
+		}
+		IOByteCount len = n * blk_size_;
+		if (args->buffer->readBytes(offset, seg->dma.kva + (block - segBlock) * blk_size_, len) != len)
+			return EIO;
+		for (UInt64 i = 0; i < n; i++)
+			bitSet(seg->dirty, block - segBlock + i);
+		block += n;
+		offset += len;
+	}
+	writeCacheArmTimer();
+	return 0;
+}
+
+/// Erases the given ranges of blocks (adjacent extents are merged). The cached copies of the blocks are dropped, dirty
+/// ones too (writing them would be wasted on blocks about to be erased), so that neither cache outlives the erase.
+/// Cached blocks of the same segments outside the ranges are left for the next flush.
+int SDDisk::unmapExtents(const IOBlockStorageDeviceExtent *extents, UInt32 extentsCount)
+{
+	UInt32 i = 0;
+	int error = 0;
+
+	while (error == 0 && i < extentsCount) {
+		UInt64 block = extents[i].blockStart;
+		UInt64 nblks = extents[i].blockCount;
+		for (i++; i < extentsCount && extents[i].blockStart == block + nblks; i++)
+			nblks += extents[i].blockCount;
+		if (nblks == 0)
+			continue;
+		if (block + nblks > num_blocks_)
+			return EINVAL;
+		stats_.unmap_ranges++;
+
+		if (ra_count_ > 0)
+			readAheadInvalidate(block, nblks);
+		if (wb_count_ > 0) {
+			IOLockLock(wb_lock_);
+			writeCacheForget(block, nblks);
+			IOLockUnlock(wb_lock_);
+		}
+
+		while (error == 0 && nblks > 0) {
+			UInt64 n = MIN(nblks, (UInt64) kMaxEraseBlocks);
+			UTL_DEBUG_FUN("ERASE (block = %u nblks = %u)", static_cast<unsigned>(block),
+				      static_cast<unsigned>(n));
+			error = sdmmc_mem_erase(sdmmc_softc_->sc_fn0, (int) block, (int) n);
+			stats_.erase_commands++;
+			if (error == 0)
+				stats_.erased_bytes += n * blk_size_;
+			block += n;
+			nblks -= n;
+		}
+	}
+	return error;
+}
+
+/// Makes sure that the aged segments will be flushed. Must be called with wb_lock_ held.
+void SDDisk::writeCacheArmTimer()
+{
+	if (wb_timer_armed_ || !wb_thread_call_)
+		return;
+	wb_timer_armed_ = true;
+	thread_call_enter_delayed(wb_thread_call_, nsecs2AbsoluteTimeDeadline(kWriteCacheMaxAgeMs * 1000000ULL));
+}
+
+void SDDisk::writeCacheThreadCall(thread_call_param_t param0, thread_call_param_t param1)
+{
+	auto that = (SDDisk *) param0;
+	uint64_t maxAge;
+	nanoseconds_to_absolutetime(kWriteCacheMaxAgeMs * 1000000ULL, &maxAge);
+
+	IOLockLock(that->wb_lock_);
+	that->wb_timer_armed_ = false;
+	uint64_t now = mach_absolute_time();
+	bool dirty = false;
+	for (int i = 0; i < that->wb_count_; i++) {
+		auto &seg = that->wb_segs_[i];
+		if (!seg.valid)
+			continue;
+		if (now - seg.dirty_since >= maxAge)
+			that->writeCacheFlushSegment(seg);
+		// still there if it could not be written, it is retried later
+		if (seg.valid)
+			dirty = true;
+	}
+	if (dirty)
+		that->writeCacheArmTimer();
+	IOLockUnlock(that->wb_lock_);
+}
+
+// cholonam: This task is put on a queue which is run by sc::task_execute_one_ (originally using a timer, now trying to
+// change to an IOCommandGate.
+// It takes the first request in bio_queue_ together with the requests that follow it on the card (same direction,
+// contiguous blocks, up to the transfer ceiling) and processes them as a single transfer. If more requests are left,
+// the task is queued again, so that other sdmmc tasks (card discovery) are not starved. When the queue is empty, it
+// reads ahead one chunk of the current sequential stream (if any).
+void read_task_impl_(void *_that)
+{
+	SDDisk *that = (SDDisk *) _that;
+	BioArgs *requests[SDDisk::kMaxMergedRequests];
+	int count = 0;
+	bool prefetch = false;
+
+	UTL_CHK_PTR(that,);
+	that->bio_task_thread_ = current_thread();
+	IOLockLock(that->util_lock_);
+	if (that->detaching_) {
+		IOLockUnlock(that->util_lock_);
+		return;
+	}
+	that->bio_task_running_ = true;
+	BioArgs *first = TAILQ_FIRST(&that->bio_queue_);
+	if (first) {
+		TAILQ_REMOVE(&that->bio_queue_, first, link);
+		requests[count++] = first;
+		UInt64 nextBlock = first->block + first->nblks;
+		UInt64 nblks = first->nblks;
+		BioArgs *next;
+		while (count < SDDisk::kMaxMergedRequests && (next = TAILQ_FIRST(&that->bio_queue_)) != nullptr &&
+		       first->direction != kIODirectionNone && next->direction == first->direction &&
+		       next->block == nextBlock &&
+		       (nblks + next->nblks) * that->blk_size_ <= that->max_xfer_bytes_) {
+			TAILQ_REMOVE(&that->bio_queue_, next, link);
+			requests[count++] = next;
+			nextBlock += next->nblks;
+			nblks += next->nblks;
+		}
+	} else if (that->ra_prefetch_pending_) {
+		// nothing else to do, read ahead
+		that->ra_prefetch_pending_ = false;
+		prefetch = true;
+	}
+	if (!that->detaching_)
+		that->scheduleRequests();
+	IOLockUnlock(that->util_lock_);
+
+	if (count > 0)
+		that->processRequests(requests, count);
+	else if (prefetch)
+		that->readAheadStep();
+
+	IOLockLock(that->util_lock_);
+	that->bio_task_running_ = false;
+	if (that->detaching_)
+		IOLockWakeup(that->util_lock_, &that->bio_task_running_, true);
+	IOLockUnlock(that->util_lock_);
+}
+
 /**
  * Start an async read or write operation.
  * @param buffer
@@ -479,7 +1807,9 @@ IOReturn SDDisk::doAsyncReadWrite(IOMemoryDescriptor *buffer,
 	 * Copy things over as we're going to lose the parameters once this
 	 * method returns. (async call)
 	 */
-	BioArgs *bioargs = new BioArgs;
+	BioArgs *bioargs = requestAlloc();
+	if (!bioargs) return kIOReturnNoMemory;
+	bzero(bioargs, sizeof(*bioargs));
 	bioargs->buffer = buffer;
 	bioargs->direction = direction;
 	bioargs->block = block;
@@ -490,10 +1820,17 @@ IOReturn SDDisk::doAsyncReadWrite(IOMemoryDescriptor *buffer,
 		bioargs->completion = *completion;
 	bioargs->that = this;
 
-	auto newTask = UTL_MALLOC(sdmmc_task); // will be deleted after processed
-	if (!newTask) return kIOReturnNoMemory;
-	sdmmc_init_task(newTask, read_task_impl_, bioargs);
-	sdmmc_add_task(sdmmc_softc_, newTask);
+	// queue the request, read_task_impl_() will merge it with its neighbours if possible
+	IOLockLock(util_lock_);
+	if (detaching_) {
+		IOLockUnlock(util_lock_);
+		requestFree(bioargs);
+		return kIOReturnNotAttached;
+	}
+	TAILQ_INSERT_TAIL(&bio_queue_, bioargs, link);
+	stats_.requests++;
+	scheduleRequests();
+	IOLockUnlock(util_lock_);
 
 	// printf("=====================================================\n");
 
@@ -501,6 +1838,59 @@ IOReturn SDDisk::doAsyncReadWrite(IOMemoryDescriptor *buffer,
 	return kIOReturnSuccess;
 }
 
+/**
+ * Unmap (discard) ranges of blocks. The request goes through bio_queue_ like reads and writes, so that it is ordered
+ * with them and with the caches, and we wait for it to complete.
+ * @param extents
+ * The ranges of blocks to unmap.
+ * @param extentsCount
+ * The number of ranges.
+ * @param options
+ * Unmap options (none are supported).
+ */
+IOReturn SDDisk::doUnmap(IOBlockStorageDeviceExtent *extents, UInt32 extentsCount, IOStorageUnmapOptions options)
+{
+	UTL_DEBUG_FUN("START (extentsCount = %u options = 0x%x)", extentsCount, options);
+
+	if (isInactive() != false)
+		return kIOReturnNotAttached;
+
+	if (!provider_->writeEnabled() || card_is_write_protected_)
+		return kIOReturnNotWritable;
+
+	if (extentsCount == 0)
+		return kIOReturnSuccess;
+
+	BioArgs *bioargs = requestAlloc();
+	if (!bioargs) return kIOReturnNoMemory;
+	bzero(bioargs, sizeof(*bioargs));
+	bioargs->direction = kIODirectionNone;
+	bioargs->extents = extents;
+	bioargs->extents_count = extentsCount;
+	bioargs->that = this;
+
+	SDDiskSyncRequest sync = { .lock = util_lock_, .status = kIOReturnSuccess, .done = false };
+	bioargs->completion.target = this;
+	bioargs->completion.action = syncRequestDone;
+	bioargs->completion.parameter = &sync;
+
+	IOLockLock(util_lock_);
+	if (detaching_) {
+		IOLockUnlock(util_lock_);
+		requestFree(bioargs);
+		return kIOReturnNotAttached;
+	}
+	TAILQ_INSERT_TAIL(&bio_queue_, bioargs, link);
+	stats_.unmap_requests++;
+	scheduleRequests();
+	while (!sync.done)
+		IOLockSleep(util_lock_, &sync, THREAD_UNINT);
+	IOLockUnlock(util_lock_);
+
+	UTL_DEBUG_FUN("END (status = 0x%x)", sync.status);
+	return sync.status;
+}
+
 #if RTSX_DEBUG_MESSAGES_RECEIVED
 IOReturn SDDisk::message(UInt32 type, IOService *provider, void *argument)
 {
@@ -1,10 +1,62 @@
 #pragma once
 
 #include <IOKit/storage/IOBlockStorageDevice.h>
+#include <IOKit/IODMACommand.h>
+#include <kern/thread_call.h>
 #include "Sinetek_rtsx.hpp"
+#include "util_slab.h"
 
 // Forward declaration
 struct rtsx_softc;
+class SDDisk;
+
+/// A read/write request received through doAsyncReadWrite(), or an unmap request (direction kIODirectionNone)
+/// received through doUnmap()
+struct BioArgs
+{
+	IOMemoryDescriptor *buffer;
+	IODirection direction;
+	UInt64 block;
+	UInt64 nblks;
+	const IOBlockStorageDeviceExtent *extents;	// unmap requests only
+	UInt32 extents_count;
+	IOStorageAttributes attributes;
+	IOStorageCompletion completion;
+	SDDisk *that;
+	TAILQ_ENTRY(BioArgs) link;
+};
+
+/// A wired, below 4 GB and kernel-mapped DMA buffer (used when a transfer cannot be done zero-copy).
+struct SDDiskDMABuffer
+{
+	u_char *			kva;
+	bus_size_t			size;
+	bus_dma_segment_t		segs[SDMMC_MAXNSEGS];
+	int				rsegs;
+	bool				pooled;		// belongs to the pool (otherwise allocated on a pool miss)
+	bool				in_use;
+};
+
+/// A read-ahead buffer, holding blocks [block, block + nblks) of the card (see SDDisk::readAheadStep()).
+struct SDDiskReadAheadBuffer
+{
+	SDDiskDMABuffer			dma;
+	UInt64				block;
+	UInt64				nblks;
+	UInt64				used_end;	// the stream has consumed (or skipped) the blocks before this one
+	bool				valid;
+};
+
+/// A write-back cache segment: dirty blocks of an aligned group of blocks, starting at 'block' (see
+/// SDDisk::writeCacheAbsorb()).
+struct SDDiskWriteCacheSegment
+{
+	SDDiskDMABuffer			dma;
+	UInt64				block;
+	uint64_t			dirty[4];	// one bit per block (segments are 256 blocks at most)
+	uint64_t			dirty_since;	// mach_absolute_time() when the segment became dirty
+	bool				valid;
+};
 
 class SDDisk : public IOBlockStorageDevice
 {
@@ -17,17 +69,161 @@ private:
 	IOLock *			util_lock_;
 	uint32_t			num_blocks_;
 	uint32_t			blk_size_;
+	IOByteCount			max_xfer_bytes_;	// largest transfer sent to the card in a single command
+	UInt64				au_blocks_;		// allocation unit of the card in blocks (0: unknown)
 	bool				card_is_write_protected_;
 	sdmmc_softc			*sdmmc_softc_; // TODO: where is this initialized?
 
+	/// Generates the scatter/gather list of the client buffer (zero-copy path). Only used from the task thread.
+	IODMACommand *			dma_command_;
+	bus_dma_segment_t		dma_segs_[SDMMC_MAXNSEGS];
+
+	/// Pool of DMA buffers allocated at attach time and recycled across requests (protected by util_lock_)
+	static constexpr int		kMaxDMAPoolBuffers = 8;
+	SDDiskDMABuffer			dma_pool_[kMaxDMAPoolBuffers];
+	int				dma_pool_count_;
+
+	/// Asynchronous bounce copy, so that copying chunk N overlaps with the card transfer of chunk N+1 (pipelined mode).
+	/// Only one copy is outstanding at any time (protected by util_lock_).
+	thread_call_t			copy_thread_call_;
+	struct {
+		IOMemoryDescriptor *	buffer;
+		IOByteCount		offset;
+		IOByteCount		length;
+		u_char *		kva;
+		bool			to_client;
+		bool			busy;
+		IOByteCount		copied;
+	} copy_job_;
+
+	/// Requests waiting to be processed by bio_task_ (protected by util_lock_). Contiguous requests in the same
+	/// direction are merged into a single transfer (see read_task_impl_()).
+	static constexpr int		kMaxMergedRequests = 16;
+	TAILQ_HEAD(, BioArgs)		bio_queue_;
+	struct sdmmc_task		bio_task_;
+
+	/// Request objects (requestAlloc() waits when the slab is exhausted, except on bio_task_thread_)
+	static constexpr uint32_t	kBioSlabCapacity = 128;
+	Slab<BioArgs>			bio_slab_;
+	volatile uint32_t		bio_slab_waiters_;
+	/// The thread running bio_task_, the only one returning requests to the slab
+	thread_t			bio_task_thread_;
+	/// detach() has started: bio_task_ is not scheduled any more and no request is accepted (protected by util_lock_)
+	bool				detaching_;
+	/// bio_task_ is running, detach() waits for it before freeing the buffers it uses (protected by util_lock_)
+	bool				bio_task_running_;
+
+	/// Sequential read-ahead: when reads follow each other on the card, the blocks after the stream are prefetched
+	/// (whenever no request is waiting) so that the next reads are served from memory. Only used from the task
+	/// thread, except ra_prefetch_pending_ (protected by util_lock_).
+	static constexpr int		kMaxReadAheadBuffers = 16;
+	static constexpr IOByteCount	kReadAheadMinWindow = 128 * 1024;
+	SDDiskReadAheadBuffer		ra_bufs_[kMaxReadAheadBuffers];
+	int				ra_count_;
+	IOByteCount			ra_window_;		// bytes to keep cached ahead of the stream
+	UInt64				ra_next_block_;		// block following the last read
+	int				ra_seq_reads_;		// reads which continued the previous one
+	bool				ra_prefetch_pending_;	// bio_task_ should call readAheadStep()
+
+	/// Write-back cache: small writes are copied to aligned segments and completed right away. Segments are written
+	/// to the card (as a single multi-block write each) when they are needed for other blocks, when the blocks are
+	/// read, on doSynchronizeCache(), on eject/sleep and when they have been dirty for kWriteCacheMaxAgeMs.
+	/// Protected by wb_lock_, which is held while flushing.
+	static constexpr int		kMaxWriteCacheSegments = 32;
+	static constexpr IOByteCount	kWriteCacheSegmentSize = 128 * 1024;
+	static constexpr uint32_t	kWriteCacheMaxAgeMs = 1000;
+	IOLock *			wb_lock_;
+	SDDiskWriteCacheSegment		wb_segs_[kMaxWriteCacheSegments];
+	int				wb_count_;
+	UInt64				wb_seg_blocks_;		// blocks per segment
+	bool				wb_enabled_;
+	thread_call_t			wb_thread_call_;	// flushes aged segments
+	bool				wb_timer_armed_;
+
+	/// Unmapped ranges are erased in chunks of (at most) this many blocks, so that the card does not stay busy for
+	/// too long with a single ERASE command.
+	static constexpr UInt64		kMaxEraseBlocks = 65536;
+
+	/// I/O statistics (published in the "RTSX Statistics" property whenever the registry is read)
+	struct {
+		uint64_t		zero_copy_requests;	// requests transferred straight from the client buffer
+		uint64_t		bounced_requests;	// requests which needed (at least one) bounce copy
+		uint64_t		dma_pool_hits;		// bounce buffers taken from the pool
+		uint64_t		dma_pool_misses;	// bounce buffers allocated on the fly (pool empty)
+		uint64_t		pipelined_requests;	// bounced requests whose copies overlapped the card transfers
+		uint64_t		requests;		// requests received from the block layer
+		uint64_t		transfers;		// transfers done (after merging)
+		uint64_t		merged_requests;	// requests merged into the transfer of a preceding request
+		uint64_t		slab_waits;		// requests which had to wait for a free request object
+		uint64_t		slab_fallbacks;		// requests allocated from the heap (task thread, or waited too long)
+		uint64_t		ra_hits;		// read requests served from the read-ahead buffers
+		uint64_t		ra_misses;		// read requests which had to go to the card
+		uint64_t		ra_prefetched_bytes;	// bytes read ahead
+		uint64_t		ra_wasted_bytes;	// bytes read ahead but never requested
+		uint64_t		wb_absorbed_requests;	// write requests completed from the write-back cache
+		uint64_t		wb_bypassed_requests;	// write requests sent to the card while the cache is enabled
+		uint64_t		wb_flushes;		// segments written to the card
+		uint64_t		wb_flushed_bytes;	// bytes written by those flushes
+		uint64_t		wb_filled_bytes;	// bytes read to fill the holes of flushed segments
+		uint64_t		wb_errors;		// failed flushes (kept for retry unless the card is gone), segments dropped unwritten
+		uint64_t		unmap_requests;		// requests received through doUnmap()
+		uint64_t		unmap_ranges;		// ranges unmapped (after merging adjacent extents)
+		uint64_t		erase_commands;		// ERASE commands sent to the card
+		uint64_t		erased_bytes;		// bytes erased by those commands
+		uint64_t		au_splits;		// write commands cut short at an allocation unit boundary
+	} stats_;
+
+	int				loadClientSegments(IOByteCount offset, IOByteCount length);
+	void				publishTransferLimits();
+	void				publishPhysicalBlockSize();
+	void				publishBusMode();
+	IOByteCount			chunkBytes(IODirection direction, UInt64 block, IOByteCount remaining);
+	void				dmaPoolCreate(int count, bus_size_t size);
+	void				dmaPoolDestroy();
+	SDDiskDMABuffer *		dmaBufferGet(bus_size_t size, int flags);
+	void				dmaBufferPut(SDDiskDMABuffer *dmaBuf);
+	void				copyStart(IOMemoryDescriptor *buffer, IOByteCount offset, u_char *kva,
+						  IOByteCount length, bool toClient);
+	bool				copyWait();
+	static void			copyThreadCall(thread_call_param_t param0, thread_call_param_t param1);
+	int				transferBlocks(IOMemoryDescriptor *buffer, IODirection direction, UInt64 block,
+						       UInt64 nblks);
+	void				processRequests(BioArgs **requests, int count);
+	void				completeRequest(BioArgs *args, int error);
+	BioArgs *			requestAlloc();
+	void				requestFree(BioArgs *args);
+	void				scheduleRequests();
+	void				readAheadCreate(IOByteCount maxBytes);
+	void				readAheadDestroy();
+	SDDiskReadAheadBuffer *		readAheadFind(UInt64 block);
+	void				readAheadDrop(SDDiskReadAheadBuffer &raBuf);
+	void				readAheadInvalidate(UInt64 block, UInt64 nblks);
+	bool				readAheadServe(BioArgs *args);
+	void				readAheadTrack(UInt64 block, UInt64 nblks);
+	void				readAheadStep();
+	void				writeCacheCreate(IOByteCount maxBytes);
+	void				writeCacheDestroy();
+	SDDiskWriteCacheSegment *	writeCacheFind(UInt64 block);
+	int				writeCacheFlushSegment(SDDiskWriteCacheSegment &seg);
+	int				writeCacheFlushRange(UInt64 block, UInt64 nblks);
+	void				writeCacheForget(UInt64 block, UInt64 nblks);
+	int				writeCacheFlushAll();
+	int				writeCacheAbsorb(BioArgs *args);
+	void				writeCacheArmTimer();
+	static void			writeCacheThreadCall(thread_call_param_t param0, thread_call_param_t param1);
+	int				unmapExtents(const IOBlockStorageDeviceExtent *extents, UInt32 extentsCount);
+	void				updateStatisticsProperty();
+
 public:
 	virtual bool		init(struct sdmmc_softc *sc_sdmmc, OSDictionary* properties = 0);
 	virtual void		free() override;
 
 	virtual bool		attach(IOService* provider) override;
 	virtual void		detach(IOService* provider) override;
+	virtual bool		serializeProperties(OSSerialize *s) const override;
 	
 	virtual IOReturn	SendMessageMediaOffline();
+	IOReturn		flushWriteCache();
 
 	/**
 	 * Subclassing requirements.
@@ -56,6 +252,8 @@ public:
 	virtual IOReturn	doAsyncReadWrite(IOMemoryDescriptor *buffer, UInt64 block, UInt64 nblks,
 						 IOStorageAttributes *attributes,
 						 IOStorageCompletion *completion) override;
+	virtual IOReturn	doUnmap(IOBlockStorageDeviceExtent *extents, UInt32 extentsCount,
+					IOStorageUnmapOptions options = 0) override;
 
 #if RTSX_DEBUG_MESSAGES_RECEIVED
 	int messages_received = 0;
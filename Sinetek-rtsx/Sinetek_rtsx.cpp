@@ -57,8 +57,20 @@ static IOPMPowerState ourPowerStates[kPowerStateCount] =
 // Use global variables, since these will be accessed from the BSD code
 int Sinetek_rtsx_boot_arg_mimic_linux = 0;
 int Sinetek_rtsx_boot_arg_no_adma = 0;
+int Sinetek_rtsx_boot_arg_no_fused_xfer = 0;
+int Sinetek_rtsx_boot_arg_no_intr_filter = 0;
+int Sinetek_rtsx_boot_arg_no_uhs = 0;
 int Sinetek_rtsx_boot_arg_timeout_shift = 0;
 int Sinetek_rtsx_boot_arg_sleep_wake_delay_ms = 0;
+int Sinetek_rtsx_boot_arg_dma_pool = 2;
+int Sinetek_rtsx_boot_arg_max_xfer_kb = 0;
+int Sinetek_rtsx_boot_arg_no_pipeline = 0;
+int Sinetek_rtsx_boot_arg_no_spin = 0;
+int Sinetek_rtsx_boot_arg_no_cmd23 = 0;
+int Sinetek_rtsx_boot_arg_ra_max_kb = 4096;
+int Sinetek_rtsx_boot_arg_write_cache = 0;
+int Sinetek_rtsx_boot_arg_write_cache_kb = 1024;
+int Sinetek_rtsx_boot_arg_pre_erase = 1;
 
 bool Sinetek_rtsx::init(OSDictionary *dictionary) {
 	if (!super::init()) return false;
@@ -69,6 +81,8 @@ bool Sinetek_rtsx::init(OSDictionary *dictionary) {
 		UTL_ERR("ERROR ALLOCATING MEMORY!");
 		return false;
 	}
+	// zeroed like OpenBSD's autoconf does (the interrupt filter looks at it before rtsx_attach() runs)
+	bzero(rtsx_softc_original_, sizeof(*rtsx_softc_original_));
 	// set device name (activate() will need it)
 	// TODO: Calling config_found
 	strlcpy(rtsx_softc_original_->sc_dev.dv_xname, "rtsx", sizeof(rtsx_softc_original_->sc_dev.dv_xname));
@@ -79,8 +93,20 @@ bool Sinetek_rtsx::init(OSDictionary *dictionary) {
 	}
 	Sinetek_rtsx_boot_arg_mimic_linux = (int) PE_parse_boot_argn("-rtsx_mimic_linux", &dummy, sizeof(dummy));
 	Sinetek_rtsx_boot_arg_no_adma = (int)PE_parse_boot_argn("-rtsx_no_adma", &dummy, sizeof(dummy));
+	Sinetek_rtsx_boot_arg_no_fused_xfer = (int)PE_parse_boot_argn("-rtsx_no_fused_xfer", &dummy, sizeof(dummy));
+	Sinetek_rtsx_boot_arg_no_intr_filter = (int)PE_parse_boot_argn("-rtsx_no_intr_filter", &dummy, sizeof(dummy));
+	Sinetek_rtsx_boot_arg_no_pipeline = (int)PE_parse_boot_argn("-rtsx_no_pipeline", &dummy, sizeof(dummy));
+	Sinetek_rtsx_boot_arg_no_spin = (int)PE_parse_boot_argn("-rtsx_no_spin", &dummy, sizeof(dummy));
+	Sinetek_rtsx_boot_arg_no_cmd23 = (int)PE_parse_boot_argn("-rtsx_no_cmd23", &dummy, sizeof(dummy));
+	Sinetek_rtsx_boot_arg_no_uhs = (int)PE_parse_boot_argn("-rtsx_no_uhs", &dummy, sizeof(dummy));
+	Sinetek_rtsx_boot_arg_write_cache = (int)PE_parse_boot_argn("-rtsx_write_cache", &dummy, sizeof(dummy));
 	PE_parse_boot_argn("rtsx_timeout_shift", &Sinetek_rtsx_boot_arg_timeout_shift, sizeof(Sinetek_rtsx_boot_arg_timeout_shift));
 	PE_parse_boot_argn("rtsx_sleep_wake_delay_ms", &Sinetek_rtsx_boot_arg_sleep_wake_delay_ms, sizeof(Sinetek_rtsx_boot_arg_sleep_wake_delay_ms));
+	PE_parse_boot_argn("rtsx_dma_pool", &Sinetek_rtsx_boot_arg_dma_pool, sizeof(Sinetek_rtsx_boot_arg_dma_pool));
+	PE_parse_boot_argn("rtsx_max_xfer_kb", &Sinetek_rtsx_boot_arg_max_xfer_kb, sizeof(Sinetek_rtsx_boot_arg_max_xfer_kb));
+	PE_parse_boot_argn("rtsx_ra_max_kb", &Sinetek_rtsx_boot_arg_ra_max_kb, sizeof(Sinetek_rtsx_boot_arg_ra_max_kb));
+	PE_parse_boot_argn("rtsx_write_cache_kb", &Sinetek_rtsx_boot_arg_write_cache_kb, sizeof(Sinetek_rtsx_boot_arg_write_cache_kb));
+	PE_parse_boot_argn("rtsx_pre_erase", &Sinetek_rtsx_boot_arg_pre_erase, sizeof(Sinetek_rtsx_boot_arg_pre_erase));
 	UTL_LOG("ADMA %s", Sinetek_rtsx_boot_arg_no_adma ? "disabled" : "enabled");
 	UTL_LOG("Timeout shift: %d", Sinetek_rtsx_boot_arg_timeout_shift);
 	UTL_DEBUG_FUN("END");
@@ -176,7 +202,9 @@ void Sinetek_rtsx::InterruptHandler(OSObject *ih, IOInterruptEventSource *ies, i
 	UTL_DEBUG_INT("Interrupt received (ies=" RTSX_PTR_FMT " count=%d)!", RTSX_PTR_FMT_VAR(ies), count);
 	/* go to isr handler */
 	auto self = OSDynamicCast(Sinetek_rtsx, ih);
-	if (self && self->rtsx_softc_original_)
+	if (self && self->rtsx_softc_original_ && self->rtsx_softc_original_->intr_filter)
+		::rtsx_intr_deferred(self->rtsx_softc_original_); // the filter did the rest
+	else if (self && self->rtsx_softc_original_)
 		::rtsx_intr(self->rtsx_softc_original_);
 	else
 		UTL_ERR("Object received is not a Sinetek_rtsx!");
@@ -225,9 +253,10 @@ void Sinetek_rtsx::rtsx_pci_attach()
 		UTL_ERR("Could not get device memory map!");
 		return;
 	}
-	memory_descriptor_ = map_->getMemoryDescriptor();
-	if (!memory_descriptor_) {
-		UTL_ERR("Could not get device memory descriptor!");
+	// registers are accessed directly through the mapping (see bus_space.h)
+	mmio_ = (bus_space_handle_t) map_->getVirtualAddress();
+	if (!mmio_) {
+		UTL_ERR("Could not get device memory address!");
 		return;
 	}
 
@@ -268,7 +297,7 @@ void Sinetek_rtsx::rtsx_pci_attach()
 	UTL_CHK_PTR(this->rtsx_softc_original_,);
 	UTL_DEBUG_DEF("Calling attach%s...", (flags & RTSX_F_525A) ? " (525A detected)" : "");
 	int error = ::rtsx_attach(this->rtsx_softc_original_, gBusSpaceTag,
-				  (bus_space_handle_t) memory_descriptor_,
+				  mmio_,
 				  0/* ignored */,
 				  gBusDmaTag, flags);
 
@@ -299,6 +328,8 @@ void Sinetek_rtsx::rtsx_pci_detach()
 
 	workloop_->removeEventSource(intr_source_);
 	UTL_SAFE_RELEASE_NULL(intr_source_);
+	// no more interrupts to post intr_status
+	mtx_destroy(&rtsx_softc_original_->intr_mtx);
 #if RTSX_USE_IOLOCK
 	// should this be called in free()?
 	UTL_CHK_PTR(splsdmmc_rec_lock,);
@@ -308,6 +339,7 @@ void Sinetek_rtsx::rtsx_pci_detach()
 	IOLockFree(this->intr_status_lock);
 	this->intr_status_lock = nullptr;
 #endif // RTSX_USE_IOLOCK
+	mmio_ = nullptr;
 	UTL_SAFE_RELEASE_NULL(map_);
 }
 
@@ -320,6 +352,9 @@ IOReturn Sinetek_rtsx::setPowerState(unsigned long powerStateOrdinal, IOService
 
 	switch (powerStateOrdinal) {
 		case kPowerStateSleep:
+			// the card may be gone on wake, write the cached blocks while we can
+			if (sddisk_)
+				sddisk_->flushWriteCache();
 			IOSleep(Sinetek_rtsx_boot_arg_sleep_wake_delay_ms);
 			// save state
 			rtsx_activate(&rtsx_softc_original_->sc_dev, DVACT_SUSPEND);
@@ -404,7 +439,6 @@ void Sinetek_rtsx::destroy_task_loop()
 
 void Sinetek_rtsx::task_execute_one_impl_(OSObject *target, IOTimerEventSource *sender)
 {
-	extern void read_task_impl_(void *_args);
 	UTL_DEBUG_DEF("  ===> TOOK TASK WORKLOOP...");
 	if (!target) return;
 	Sinetek_rtsx *sc = OSDynamicCast(Sinetek_rtsx, target);
@@ -414,20 +448,12 @@ void Sinetek_rtsx::task_execute_one_impl_(OSObject *target, IOTimerEventSource *
 	IORecursiveLockLock(sc->splsdmmc_rec_lock);
 #endif
 	struct sdmmc_softc *sdmmc = (struct sdmmc_softc *) sc->rtsx_softc_original_->sdmmc;
-	auto tskq = &sdmmc->sc_tskq;
-	for (task = TAILQ_FIRST(tskq); task != NULL;
-	     task = TAILQ_FIRST(tskq)) {
-		UTL_DEBUG_LOOP("  => Executing one task (CRASHED HERE!)...");
-		// remove task from queue (clang static analyzer gives false "Use of memory after it is freed")
-		sdmmc_del_task(task);
-		UTL_DEBUG_LOOP("  => Task deleted from queue");
+	// sdmmc_task_take() takes the task off the queue (this must be the only consumer)
+	while ((task = sdmmc_task_take(sdmmc)) != NULL) {
+		UTL_DEBUG_LOOP("  => Executing one task...");
 		task->func(task->arg);
 		UTL_DEBUG_LOOP("  => Executed one task!");
-		if (task->func == read_task_impl_) {
-			// free only read_task
-			UTL_DEBUG_LOOP("Freeing read task...");
-			UTL_FREE(task, sizeof(sdmmc_task));
-		}
+		// read tasks are not allocated per request anymore (SDDisk owns its task), so there is nothing to free
 	}
 #if RTSX_USE_IOLOCK
 	IORecursiveLockUnlock(sc->splsdmmc_rec_lock);
@@ -487,14 +513,6 @@ void Sinetek_rtsx::blk_detach()
 	UTL_DEBUG_FUN("END");
 }
 
-uint32_t Sinetek_rtsx::READ4(IOByteCount offset)
-{
-	uint32_t ret = 0;
-	this->memory_descriptor_->readBytes(offset, &ret, 4);
-	// we cannot log here
-	return ret;
-}
-
 /// This function runs in interrupt context, meaning that IOLog CANNOT be used (only basic functionality is available).
 bool Sinetek_rtsx::InterruptFilter(OSObject *arg, IOFilterInterruptEventSource *source)
 {
@@ -504,6 +522,11 @@ bool Sinetek_rtsx::InterruptFilter(OSObject *arg, IOFilterInterruptEventSource *
 	Sinetek_rtsx *sc = OSDynamicCast(Sinetek_rtsx, arg);
 	if (!sc) return false;
 
+	// Once attached, the interrupt is acknowledged and commands are completed here, and only card
+	// insertion/removal goes to InterruptHandler() (unless -rtsx_no_intr_filter).
+	if (sc->rtsx_softc_original_ && sc->rtsx_softc_original_->intr_filter)
+		return ::rtsx_intr_filter(sc->rtsx_softc_original_) != 0;
+
 	auto status = sc->READ4(RTSX_BIPR);
 	if (!status) {
 		return false;
@@ -535,8 +558,7 @@ IOReturn Sinetek_rtsx::executeOneCommandGateAction(OSObject *obj,
 #endif // RTSX_USE_IOCOMMANDGATE
 
 bool Sinetek_rtsx::cardIsWriteProtected() {
-	auto bipr = ::bus_space_read_4(gBusSpaceTag,
-				       (bus_space_handle_t) memory_descriptor_, RTSX_BIPR);
+	auto bipr = ::bus_space_read_4(gBusSpaceTag, mmio_, RTSX_BIPR);
 	return (bipr & RTSX_SD_WRITE_PROTECT) != 0;
 }
 
@@ -18,6 +18,7 @@
 __BEGIN_DECLS
 #include "sdmmcvar.h"
 __END_DECLS
+#include "compat/openbsd/bus_space.h" // bus_space_read_4
 
 // forward declarations
 struct rtsx_softc;
@@ -47,14 +48,17 @@ public:
 	void blk_attach();
 	void blk_detach();
 
-	uint32_t READ4(IOByteCount offset);
+	uint32_t READ4(IOByteCount offset) {
+		// same access as the OpenBSD code, usable from the interrupt filter (we cannot log here)
+		return bus_space_read_4(nullptr, mmio_, offset);
+	}
 	static bool InterruptFilter(OSObject *arg, IOFilterInterruptEventSource *source);
 
 	// ** //
 	IOPCIDevice *		provider_;
 	IOWorkLoop *		workloop_;
 	IOMemoryMap *		map_;
-	IOMemoryDescriptor *	memory_descriptor_;
+	bus_space_handle_t	mmio_;		// registers, mapped by map_
 	IOFilterInterruptEventSource *intr_source_;
 #if RTSX_USE_IOCOMMANDGATE
 	void executeOneAsCommand();
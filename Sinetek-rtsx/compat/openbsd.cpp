@@ -16,6 +16,9 @@ int openbsd_compat_start(void *owner)
 		UTL_ERR("Did you try to initialize twice?");
 		return ENOTSUP;
 	}
+	int error = Sinetek_rtsx_openbsd_compat_spl_start();
+	if (error)
+		return error;
 	Sinetek_rtsx_openbsd_compat_owner = owner;
 	((Sinetek_rtsx *)Sinetek_rtsx_openbsd_compat_owner)->retain();
 	return 0;
@@ -30,6 +33,7 @@ void openbsd_compat_stop()
 	}
 	((Sinetek_rtsx *)Sinetek_rtsx_openbsd_compat_owner)->release();
 	Sinetek_rtsx_openbsd_compat_owner = nullptr;
+	Sinetek_rtsx_openbsd_compat_spl_stop();
 }
 
 /// Should attach the block device (SDDisk)
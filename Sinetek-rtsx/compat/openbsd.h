@@ -22,6 +22,7 @@ __END_DECLS
 #include "openbsd/config.h" // config_*
 #include "openbsd/dma.h" // DMA-related functions
 #include "openbsd/kthread.h" // kthread_*
+#include "openbsd/mutex.h" // mtx_*, msleep_nsec
 #include "openbsd/queue.h" // SIMPLEQ -> STAILQ
 #include "openbsd/rwlock.h" // rw_*
 #include "openbsd/spl.h" // spl*
@@ -5,11 +5,24 @@
 
 #include "types.h"
 
+// bus_space_handle_t is the kernel virtual address of the mapped BAR (IOMemoryMap::getVirtualAddress()). Device
+// memory is mapped uncached, so a volatile load or store is a single register access, done in program order (like
+// OpenBSD does on amd64). These are called for every register access, so they are inlined.
+
 __BEGIN_DECLS
 
-u_int32_t bus_space_read_4(bus_space_tag_t space, bus_space_handle_t handle, bus_size_t offset);
+static inline u_int32_t bus_space_read_4(bus_space_tag_t space, bus_space_handle_t handle, bus_size_t offset)
+{
+	return *(volatile u_int32_t *) ((volatile char *) handle + offset);
+}
 
-void bus_space_write_4(bus_space_tag_t space, bus_space_handle_t handle, bus_size_t offset, u_int32_t value);
+static inline void bus_space_write_4(bus_space_tag_t space, bus_space_handle_t handle, bus_size_t offset,
+				     u_int32_t value)
+{
+	// don't let the compiler move memory writes (i.e.: command buffers the write starts DMA on) past it
+	__asm__ __volatile__("" ::: "memory");
+	*(volatile u_int32_t *) ((volatile char *) handle + offset) = value;
+}
 
 __END_DECLS
 
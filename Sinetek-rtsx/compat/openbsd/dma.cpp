@@ -20,7 +20,8 @@ bus_space_tag_t gBusSpaceTag = {};
 bus_dma_tag_t gBusDmaTag = (bus_dma_tag_t) &_busDmaTag;
 
 /// class to keep track of the segments belonging to a virtual address
-typedef StaticDictionary<void *, bus_dma_segment_t *> VA_SEGS;
+/// (the SDDisk DMA buffer pool keeps some of its entries busy for as long as the card is attached)
+typedef StaticDictionary<void *, bus_dma_segment_t *, 32> VA_SEGS;
 UTL_STATIC_DICT_INIT(VA_SEGS);
 
 // bus_dmamap_create();         /* get a dmamap to load/unload          */
@@ -182,6 +183,47 @@ bus_dmamap_load(bus_dma_tag_t tag, bus_dmamap_t dmam, void *buf, bus_size_t bufl
 	return 0;
 }
 
+int
+bus_dmamap_load_raw(bus_dma_tag_t tag, bus_dmamap_t dmam, bus_dma_segment_t *segs, int nsegs, bus_size_t size,
+		    int flags)
+{
+	UTL_DEBUG_FUN("START");
+	UTL_CHK_PTR(dmam, EINVAL);
+	UTL_CHK_PTR(segs, EINVAL);
+
+	if (nsegs <= 0 || nsegs > dmam->_dm_segcnt) {
+		UTL_ERR("Invalid number of segments (%d, max is %d)!", nsegs, dmam->_dm_segcnt);
+		return EINVAL;
+	}
+	if (size > dmam->_dm_size) {
+		UTL_ERR("Transfer too large for dmamap (%lu vs %lu)!", size, dmam->_dm_size);
+		return EINVAL;
+	}
+
+	bus_size_t total = 0;
+	for (int i = 0; i < nsegs; i++) {
+		if (segs[i].ds_len == 0 || (dmam->_dm_maxsegsz && segs[i].ds_len > dmam->_dm_maxsegsz)) {
+			UTL_ERR("Invalid segment length (seg %d, len %llu, maxsegsz %lu)!", i, segs[i].ds_len,
+				dmam->_dm_maxsegsz);
+			return EINVAL;
+		}
+		dmam->dm_segs[i].ds_addr = segs[i].ds_addr;
+		dmam->dm_segs[i].ds_len = segs[i].ds_len;
+		total += segs[i].ds_len;
+	}
+	if (total != size) {
+		UTL_ERR("Segments do not add up to transfer size (%lu vs %lu)!", total, size);
+		return EINVAL;
+	}
+
+	dmam->dm_mapsize = size;
+	dmam->dm_nsegs = nsegs;
+	dmam->dm_segs[0]._ds_memDesc = nullptr;
+	dmam->dm_segs[0]._ds_memMap = nullptr;
+	UTL_DEBUG_FUN("END");
+	return 0;
+}
+
 void
 bus_dmamap_unload(bus_dma_tag_t dmat, bus_dmamap_t map)
 {
@@ -56,6 +56,14 @@ bus_dmamap_destroy(bus_dma_tag_t tag, bus_dmamap_t dmamp);
 int
 bus_dmamap_load(bus_dma_tag_t tag, bus_dmamap_t dmam, void *buf, bus_size_t buflen, struct proc *p, int flags);
 
+/// Loads a DMA handle with a scatter/gather list that has already been generated by the caller.
+///
+/// The segments must describe wired memory reachable by the device. Only the public members (ds_addr and ds_len) are
+/// copied, so the memory stays owned by whoever generated the list.
+int
+bus_dmamap_load_raw(bus_dma_tag_t tag, bus_dmamap_t dmam, bus_dma_segment_t *segs, int nsegs, bus_size_t size,
+		    int flags);
+
 /// Delete the mappings for a given DMA handle.
 void
 bus_dmamap_unload(bus_dma_tag_t dmat, bus_dmamap_t map);
@@ -0,0 +1,101 @@
+#include "mutex.h"
+
+#include <sys/errno.h>
+#include <IOKit/IOLocks.h> // IOSimpleLock
+#include <kern/sched_prim.h> // assert_wait, thread_block
+#include <machine/machine_routines.h> // ml_set_interrupts_enabled
+
+#include "tsleep.h" // INFSLP
+#define UTL_THIS_CLASS ""
+#include "util.h"
+
+// OpenBSD mutexes are spin locks which raise the IPL; here they are IOSimpleLocks, and any IPL above IPL_NONE
+// disables interrupts on this CPU while the lock is held, which is what makes it safe to take them from primary
+// interrupt context too. They must not be held across anything that can block, msleep_nsec() drops the lock while it
+// sleeps.
+
+void mtx_init(struct mutex *mtx, int ipl)
+{
+	UTL_CHK_PTR(mtx,);
+	mtx->mtx_lock = IOSimpleLockAlloc();
+	mtx->mtx_ipl = ipl;
+	mtx->mtx_intr = 0;
+	mtx->mtx_acquired = 0;
+	bzero(&mtx->mtx_stats, sizeof(mtx->mtx_stats));
+	if (!mtx->mtx_lock)
+		UTL_ERR("Cannot allocate mutex!");
+}
+
+void mtx_destroy(struct mutex *mtx)
+{
+	UTL_CHK_PTR(mtx,);
+	if (mtx->mtx_lock) {
+		IOSimpleLockFree((IOSimpleLock *) mtx->mtx_lock);
+		mtx->mtx_lock = nullptr;
+	}
+}
+
+void mtx_enter(struct mutex *mtx)
+{
+	uint64_t wait_start = 0;
+	// like IOSimpleLockLockDisableInterrupt(), but we want to try the lock first
+	boolean_t intr = mtx->mtx_ipl != IPL_NONE ? ml_set_interrupts_enabled(FALSE) : FALSE;
+
+	if (!IOSimpleLockTryLock((IOSimpleLock *) mtx->mtx_lock)) {
+		wait_start = mach_absolute_time();
+		IOSimpleLockLock((IOSimpleLock *) mtx->mtx_lock);
+	}
+	mtx->mtx_intr = intr;
+	mtx->mtx_acquired = Sinetek_rtsx_openbsd_compat_lock_acquired(&mtx->mtx_stats, wait_start);
+}
+
+void mtx_leave(struct mutex *mtx)
+{
+	boolean_t intr = mtx->mtx_intr;
+
+	Sinetek_rtsx_openbsd_compat_lock_released(&mtx->mtx_stats, mtx->mtx_acquired);
+	IOSimpleLockUnlock((IOSimpleLock *) mtx->mtx_lock);
+	if (mtx->mtx_ipl != IPL_NONE)
+		ml_set_interrupts_enabled(intr);
+}
+
+// The wait is asserted before the lock is dropped, so a wakeup() issued by somebody holding the lock cannot be missed.
+int msleep_nsec(void *ident, struct mutex *mtx, int priority, const char *wmesg, uint64_t nsecs)
+{
+	wait_result_t ret;
+
+	if (nsecs == INFSLP)
+		assert_wait((event_t) ident, THREAD_UNINT);
+	else
+		assert_wait_deadline((event_t) ident, THREAD_UNINT, nsecs2AbsoluteTimeDeadline(nsecs));
+	mtx_leave(mtx);
+	ret = thread_block(THREAD_CONTINUE_NULL);
+	mtx_enter(mtx);
+	UTL_DEBUG_LOOP("%s: msleep_nsec ret = %d", wmesg ? wmesg : "(null)", ret);
+	return ret == THREAD_TIMED_OUT ? EWOULDBLOCK : 0;
+}
+
+/// Called right after taking a lock (wait_start is 0 if it was free), returns the time it was taken.
+uint64_t Sinetek_rtsx_openbsd_compat_lock_acquired(struct lock_stats *ls, uint64_t wait_start)
+{
+	uint64_t now = mach_absolute_time(), ns;
+
+	ls->ls_acquires++;
+	if (wait_start) {
+		absolutetime_to_nanoseconds(now - wait_start, &ns);
+		ls->ls_contended++;
+		ls->ls_wait_ns += ns;
+	}
+	return now;
+}
+
+/// Called right before releasing a lock taken at acquired.
+void Sinetek_rtsx_openbsd_compat_lock_released(struct lock_stats *ls, uint64_t acquired)
+{
+	uint64_t ns;
+
+	absolutetime_to_nanoseconds(mach_absolute_time() - acquired, &ns);
+	ls->ls_hold_ns += ns;
+	if (ns > ls->ls_hold_max_ns)
+		ls->ls_hold_max_ns = ns;
+}
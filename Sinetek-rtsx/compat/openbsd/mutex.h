@@ -0,0 +1,39 @@
+#ifndef SINETEK_RTSX_COMPAT_OPENBSD_MUTEX_H
+#define SINETEK_RTSX_COMPAT_OPENBSD_MUTEX_H
+
+#include <sys/cdefs.h> // __BEGIN_DECLS, __END_DECLS
+
+#include "types.h" // struct mutex, struct lock_stats
+
+// Interrupt levels are only told apart from IPL_NONE: a mutex initialized with a higher level keeps interrupts
+// disabled while it is held, so it can also be taken by the interrupt filter (see rtsx_intr_filter()).
+#define IPL_NONE 0
+#define IPL_BIO  1
+
+#define mtx_init    Sinetek_rtsx_openbsd_compat_mtx_init
+#define mtx_destroy Sinetek_rtsx_openbsd_compat_mtx_destroy
+#define mtx_enter   Sinetek_rtsx_openbsd_compat_mtx_enter
+#define mtx_leave   Sinetek_rtsx_openbsd_compat_mtx_leave
+#define msleep_nsec Sinetek_rtsx_openbsd_compat_msleep_nsec
+
+__BEGIN_DECLS
+
+void mtx_init(struct mutex *mtx, int ipl);
+
+// not in OpenBSD (mutexes need no resources there)
+void mtx_destroy(struct mutex *mtx);
+
+void mtx_enter(struct mutex *mtx);
+
+void mtx_leave(struct mutex *mtx);
+
+int msleep_nsec(void *ident, struct mutex *mtx, int priority, const char *wmesg, uint64_t nsecs);
+
+// lock statistics, shared with spl.cpp
+uint64_t Sinetek_rtsx_openbsd_compat_lock_acquired(struct lock_stats *ls, uint64_t wait_start);
+
+void Sinetek_rtsx_openbsd_compat_lock_released(struct lock_stats *ls, uint64_t acquired);
+
+__END_DECLS
+
+#endif // SINETEK_RTSX_COMPAT_OPENBSD_MUTEX_H
@@ -1,5 +1,7 @@
 #include "spl.h"
 
+#include <sys/errno.h> // ENOMEM
+
 #include <machine/machine_routines.h> // FALSE
 
 #define UTL_THIS_CLASS ""
@@ -14,48 +16,107 @@
 // while holding an IOSimpleLock (a spin-lock) will crash the kernel. For this reason, we need to modify the BSD code
 // slightly to release the lock right before calling tsleep_nsec(), and reacquire it after.
 
-// Also, using IORecursiveLock will probably allow us to use IORecursiveLockSleep/IORecursiveLockSleepDeadline/
-// IORecursiveLockWakeup for tsleep/wakeup. TODO: Look into this.
+// Also, using IORecursiveLock allows us to use IORecursiveLockSleep/IORecursiveLockSleepDeadline/
+// IORecursiveLockWakeup for tsleep/wakeup.
+
+// The lock is the controller lock: splsdmmc() has no softc argument in the OpenBSD code, but the compatibility
+// layer only serves one controller (see openbsd_compat_start()). The interrupt status handoff and the sdmmc task
+// queue have their own mutexes (see mutex.h), so the interrupt handler never waits for a command in progress.
 
 #include <IOKit/IOLocks.h>
 
-IORecursiveLock *globalLock = nullptr;
+#include "mutex.h" // Sinetek_rtsx_openbsd_compat_lock_*
 
-static int  MyRecursiveLockLock  (IORecursiveLock *l)      { IORecursiveLockLock(l); return 0; }
-static void MyRecursiveLockUnLock(IORecursiveLock *l, int) { IORecursiveLockUnlock(l); }
-#define LOCK	MyRecursiveLockLock
-#define UNLOCK	MyRecursiveLockUnLock
+static IORecursiveLock *globalLock = nullptr;
+static int globalLockDepth = 0;		// recursion depth, only touched by the holder
+static uint64_t globalLockAcquired = 0;	// mach_absolute_time() of the outermost acquisition
+static struct lock_stats globalLockStats;
 
 #define RTSX_STRING(a) RTSX_STRING2(a)
 #define RTSX_STRING2(a)	#a
 
-static IORecursiveLock *getGlobalLock()
+static spl_t LOCK()
 {
-	if (!globalLock) {
-		// TODO: There is a race condition here! (globalLock must be initialized before we create the thread).
-		UTL_DEBUG_MEM("Allocating global IOSimpleLock");
-		globalLock = IORecursiveLockAlloc();
+	uint64_t wait_start = 0;
+
+	if (IORecursiveLockHaveLock(globalLock)) {
+		IORecursiveLockLock(globalLock);
+		globalLockDepth++;
+		return 0;
+	}
+	if (!IORecursiveLockTryLock(globalLock)) {
+		wait_start = mach_absolute_time();
+		IORecursiveLockLock(globalLock);
+	}
+	globalLockDepth = 1;
+	globalLockAcquired = Sinetek_rtsx_openbsd_compat_lock_acquired(&globalLockStats, wait_start);
+	return 0;
+}
+
+static void UNLOCK(spl_t)
+{
+	if (--globalLockDepth == 0)
+		Sinetek_rtsx_openbsd_compat_lock_released(&globalLockStats, globalLockAcquired);
+	IORecursiveLockUnlock(globalLock);
+}
+
+int Sinetek_rtsx_openbsd_compat_spl_start()
+{
+	// allocated before any thread can use it
+	UTL_DEBUG_MEM("Allocating global IORecursiveLock");
+	globalLock = IORecursiveLockAlloc();
+	UTL_CHK_PTR(globalLock, ENOMEM);
+	globalLockDepth = 0;
+	bzero(&globalLockStats, sizeof(globalLockStats));
+	return 0;
+}
+
+void Sinetek_rtsx_openbsd_compat_spl_stop()
+{
+	if (globalLock) {
+		IORecursiveLockFree(globalLock);
+		globalLock = nullptr;
 	}
-	return globalLock;
 }
 
 void *Sinetek_rtsx_openbsd_compat_spl_getGlobalLock() {
-	return getGlobalLock();
+	return globalLock;
+}
+
+/// Sleeps on the held controller lock (which is released during the sleep), deadline 0 means no deadline.
+int Sinetek_rtsx_openbsd_compat_spl_sleep(void *ident, uint64_t deadline)
+{
+	int depth = globalLockDepth, ret;
+
+	globalLockDepth = 0;
+	Sinetek_rtsx_openbsd_compat_lock_released(&globalLockStats, globalLockAcquired);
+	if (deadline == 0)
+		ret = IORecursiveLockSleep(globalLock, ident, THREAD_UNINT);
+	else
+		ret = IORecursiveLockSleepDeadline(globalLock, ident, deadline, THREAD_UNINT);
+	globalLockDepth = depth;
+	globalLockAcquired = Sinetek_rtsx_openbsd_compat_lock_acquired(&globalLockStats, 0);
+	return ret;
+}
+
+void Sinetek_rtsx_openbsd_compat_spl_stats(struct lock_stats *ls)
+{
+	*ls = globalLockStats;
 }
 
 spl_t Sinetek_rtsx_openbsd_compat_splbio()
 {
-	spl_t ret = LOCK(getGlobalLock());
+	spl_t ret = LOCK();
 	return ret;
 }
 
 spl_t Sinetek_rtsx_openbsd_compat_splhigh()
 {
-	spl_t ret = LOCK(getGlobalLock());
+	spl_t ret = LOCK();
 	return ret;
 }
 
 void  Sinetek_rtsx_openbsd_compat_splx(spl_t val)
 {
-	UNLOCK(getGlobalLock(), val);
+	UNLOCK(val);
 }
@@ -2,6 +2,7 @@
 #define SINETEK_RTSX_COMPAT_OPENBSD_SPL_H
 
 #include <sys/cdefs.h> // __BEGIN_DECLS, __END_DECLS
+#include <sys/types.h> // uint64_t
 
 typedef unsigned spl_t;
 
@@ -29,9 +30,20 @@ typedef unsigned spl_t;
 
 __BEGIN_DECLS
 
+// called by openbsd_compat_start()/openbsd_compat_stop()
+int Sinetek_rtsx_openbsd_compat_spl_start(void);
+
+void Sinetek_rtsx_openbsd_compat_spl_stop(void);
+
 // to be called only by openbsd_compat_tsleep.cpp
 void *Sinetek_rtsx_openbsd_compat_spl_getGlobalLock(void);
 
+int Sinetek_rtsx_openbsd_compat_spl_sleep(void *ident, uint64_t deadline);
+
+// controller lock statistics (published by SDDisk)
+struct lock_stats;
+void Sinetek_rtsx_openbsd_compat_spl_stats(struct lock_stats *ls);
+
 spl_t Sinetek_rtsx_openbsd_compat_splbio(void);
 
 spl_t Sinetek_rtsx_openbsd_compat_splhigh(void);
@@ -4,7 +4,7 @@
 #include <IOKit/IOLocks.h> // IORecursiveLock
 
 
-#include "spl.h" // Sinetek_rtsx_openbsd_compat_spl_getGlobalLock()
+#include "spl.h" // Sinetek_rtsx_openbsd_compat_spl_getGlobalLock(), Sinetek_rtsx_openbsd_compat_spl_sleep()
 #define UTL_THIS_CLASS ""
 #include "util.h"
 
@@ -34,14 +34,8 @@ int tsleep_nsec(void *ident, int priority, const char *wmesg, uint64_t nsecs)
 		return EAGAIN;
 	}
 	int ret;
-	if (nsecs == INFSLP) {
-		// sleep without deadline
-		ret = IORecursiveLockSleep((IORecursiveLock *) Sinetek_rtsx_openbsd_compat_spl_getGlobalLock(),
-					   ident, THREAD_UNINT);
-	} else {
-		ret = IORecursiveLockSleepDeadline((IORecursiveLock *) Sinetek_rtsx_openbsd_compat_spl_getGlobalLock(),
-						   ident, nsecs2AbsoluteTimeDeadline(nsecs), THREAD_UNINT);
-	}
+	// sleep without deadline if nsecs == INFSLP
+	ret = Sinetek_rtsx_openbsd_compat_spl_sleep(ident, nsecs == INFSLP ? 0 : nsecs2AbsoluteTimeDeadline(nsecs));
 	UTL_DEBUG_LOOP("tsleep_nsec ret = %d (%s)", ret,
 		      ret == THREAD_AWAKENED ? "THREAD_AWAKENED" :
 		      ret == THREAD_TIMED_OUT ? "THREAD_TIME_OUT" : "?");
@@ -53,11 +47,9 @@ int tsleep_nsec(void *ident, int priority, const char *wmesg, uint64_t nsecs)
 	}
 }
 
+// No logging here: this is also called by the interrupt filter, in primary interrupt context.
 int wakeup(void *ident) {
-	UTL_DEBUG_LOOP("wakeup called (havelock=%d)",
-		      IORecursiveLockHaveLock((IORecursiveLock *) Sinetek_rtsx_openbsd_compat_spl_getGlobalLock()));
 	IORecursiveLockWakeup((IORecursiveLock *) Sinetek_rtsx_openbsd_compat_spl_getGlobalLock(),
 			      ident, true);
-	UTL_DEBUG_LOOP("wakeup returns");
 	return 0;
 }
@@ -17,6 +17,22 @@ struct rwlock {
 	uint8_t space[2 * LCK_RW_T_SIZE]; // take twice the space, just in case
 };
 
+struct lock_stats {
+	uint64_t ls_acquires;    // times the lock was taken
+	uint64_t ls_contended;   // times it had to be waited for
+	uint64_t ls_wait_ns;     // total time spent waiting for it
+	uint64_t ls_hold_ns;     // total time it was held
+	uint64_t ls_hold_max_ns; // longest time it was held
+};
+
+struct mutex {
+	void *             mtx_lock;     // IOSimpleLock
+	int                mtx_ipl;      // IPL_NONE: interrupts stay enabled while held
+	int                mtx_intr;     // interrupt state to restore on mtx_leave()
+	uint64_t           mtx_acquired; // mach_absolute_time() when taken
+	struct lock_stats  mtx_stats;
+};
+
 struct IOMemoryMap;              // forward declaration
 struct IOBufferMemoryDescriptor; // forward declaration
 typedef struct {
@@ -12,6 +12,7 @@
 #include "util_logging.h"
 #if __cplusplus
 #include "util_dict.h"
+#include "util_slab.h"
 #endif
 #pragma mark -
 #pragma mark Memory functions
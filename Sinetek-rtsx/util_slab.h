@@ -0,0 +1,83 @@
+#pragma once
+
+#include <IOKit/IOLib.h> // IOMalloc / IOFree
+#include <libkern/OSAtomic.h> // OSCompareAndSwap64
+#include <string.h> // bzero
+
+/*
+ * Fixed-capacity pool of objects with a lock-free free list (Treiber stack), so that taking/returning an object never
+ * calls the kernel allocator.
+ * The head of the free list keeps a generation count in the upper 32 bits (the index of the first free entry is in
+ * the lower 32 bits), so that a compare-and-swap against a stale head fails (ABA problem).
+ * T must be a POD type.
+ */
+template <typename T> class Slab {
+	struct Entry {
+		T                 object; // must be the first member (see put())
+		volatile uint32_t next;
+	};
+
+	Entry *           entries = nullptr;
+	uint32_t          capacity = 0;
+	volatile uint64_t head = 0;
+
+	static inline uint64_t makeHead(uint64_t oldHead, uint32_t idx)
+	{
+		return (((oldHead >> 32) + 1) << 32) | idx;
+	}
+
+public:
+	bool init(uint32_t cap)
+	{
+		if (cap == 0)
+			return false;
+		entries = (Entry *) IOMalloc(sizeof(Entry) * cap);
+		if (!entries)
+			return false;
+		bzero(entries, sizeof(Entry) * cap);
+		capacity = cap;
+		for (uint32_t i = 0; i < cap; i++)
+			entries[i].next = i + 1; // 'capacity' marks the end of the list
+		head = 0;
+		return true;
+	}
+
+	void free()
+	{
+		if (entries)
+			IOFree(entries, sizeof(Entry) * capacity);
+		entries = nullptr;
+		capacity = 0;
+		head = 0;
+	}
+
+	/// Returns nullptr if the slab is exhausted (or not initialized).
+	T *get()
+	{
+		while (true) {
+			uint64_t oldHead = head;
+			uint32_t idx = (uint32_t) oldHead;
+			if (idx >= capacity)
+				return nullptr;
+			uint64_t newHead = makeHead(oldHead, entries[idx].next);
+			if (OSCompareAndSwap64(oldHead, newHead, &head))
+				return &entries[idx].object;
+		}
+	}
+
+	void put(T *object)
+	{
+		uint32_t idx = (uint32_t) ((Entry *) object - entries);
+		while (true) {
+			uint64_t oldHead = head;
+			entries[idx].next = (uint32_t) oldHead;
+			if (OSCompareAndSwap64(oldHead, makeHead(oldHead, idx), &head))
+				return;
+		}
+	}
+
+	bool contains(const T *object) const
+	{
+		return entries && (const Entry *) object >= entries && (const Entry *) object < entries + capacity;
+	}
+};